@@ -1,7 +1,6 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/json.h>
 #include <linux/module.h>
-#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
 #include <linux/utsname.h>
@@ -11,38 +10,7 @@
 #include "org.kernel.devices.usb.varlink.c.inc"
 
 static struct varlink_service *service;
-
-struct monitor {
-	struct list_head node;
-	struct varlink_connection *conn;
-};
-static LIST_HEAD(monitor_list);
-static DEFINE_MUTEX(monitor_lock);
-
-static struct monitor *monitor_add(struct varlink_connection *conn)
-{
-	struct monitor *m;
-
-	m = kmalloc(sizeof(struct monitor), GFP_KERNEL);
-	m->conn = conn;
-
-	mutex_lock(&monitor_lock);
-	list_add(&m->node, &monitor_list);
-	mutex_unlock(&monitor_lock);
-
-	return m;
-}
-
-static void monitor_remove(struct varlink_connection *conn, void *userdata)
-{
-	struct monitor *m = userdata;
-
-	mutex_lock(&monitor_lock);
-	list_del(&m->node);
-	mutex_unlock(&monitor_lock);
-
-	kfree(m);
-}
+static struct varlink_topic *usb_topic;
 
 static int org_kernel_sysinfo_GetInfo(struct varlink_connection *connection,
 				      const char *method,
@@ -231,54 +199,62 @@ out:
 	return r;
 }
 
+/* Writes a device as an element of the devices array. */
+static int usb_device_write(struct usb_device *usb_device, void *userdata)
+{
+	struct json_writer *writer = userdata;
+
+	json_writer_begin_object(writer);
+	json_writer_key(writer, "vendor_id");
+	json_writer_int(writer, le16_to_cpu(usb_device->descriptor.idVendor));
+	json_writer_key(writer, "product_id");
+	json_writer_int(writer, le16_to_cpu(usb_device->descriptor.idProduct));
+	json_writer_key(writer, "bus_nr");
+	json_writer_int(writer, usb_device->bus->busnum);
+	json_writer_key(writer, "device_nr");
+	json_writer_int(writer, usb_device->devnum);
+	json_writer_key(writer, "product");
+	json_writer_string(writer, usb_device->product ?: "");
+	json_writer_key(writer, "manufacturer");
+	json_writer_string(writer, usb_device->manufacturer ?: "");
+	json_writer_key(writer, "serial");
+	json_writer_string(writer, usb_device->serial ?: "");
+
+	/* Errors stick to the writer, a non-zero return stops the walk. */
+	return json_writer_end_object(writer) < 0;
+}
+
 static int org_kernel_devices_usb_Monitor(struct varlink_connection *connection,
 					  const char *method,
 					  struct json_object *parameters,
 					  long long flags,
 					  void *userdata)
 {
-	struct json_array *devices = NULL;
-	struct json_object *reply = NULL;
+	struct json_writer *writer;
 	int r;
 
-	r = json_array_new(&devices);
-	if (r < 0)
-		return r;
-
-	/* Add all current devices to the array */
-	r = usb_for_each_dev(devices, usb_device_add);
-	if (r < 0)
-		goto out;
-
-	r = json_object_new(&reply);
+	/* The snapshot of all devices is written without building objects. */
+	r = varlink_connection_reply_begin(connection,
+					   flags & VARLINK_CALL_MORE ?
+					   VARLINK_REPLY_CONTINUES : 0,
+					   &writer);
 	if (r < 0)
 		return r;
 
-	r = json_object_set_string(reply, "event", "current");
-	if (r < 0)
-		return r;
+	json_writer_key(writer, "event");
+	json_writer_string(writer, "current");
+	json_writer_key(writer, "devices");
+	json_writer_begin_array(writer);
+	usb_for_each_dev(writer, usb_device_write);
+	json_writer_end_array(writer);
 
-	r = json_object_set_array(reply, "devices", devices);
+	r = varlink_connection_reply_end(connection);
 	if (r < 0)
 		return r;
 
-	if (flags & VARLINK_CALL_MORE) {
-		struct monitor *m;
-
-		r = varlink_connection_reply(connection,
-					     VARLINK_REPLY_CONTINUES,
-					     reply);
-
-		m = monitor_add(connection);
-		varlink_connection_set_closed_callback(connection,
-						       monitor_remove, m);
-
-	} else
-		r = varlink_connection_reply(connection, 0, reply);
+	if (flags & VARLINK_CALL_MORE)
+		r = varlink_topic_subscribe(usb_topic, connection);
 
-out:
-	json_object_unref(reply);
-	json_array_unref(devices);
 	return r;
 }
 
@@ -289,9 +265,11 @@ static int usb_bus_notify(struct notifier_block *nb, unsigned long val,
 	struct json_array *devices = NULL;
 	const char *action = NULL;
 	struct json_object *reply = NULL;
-	struct monitor *m;
 	int r;
 
+	/* Cached replies of Info may describe a different device now. */
+	varlink_service_invalidate(service, "org.kernel.devices.usb.Info", NULL);
+
 	r = json_array_new(&devices);
 	if (r < 0)
 		goto out;
@@ -317,10 +295,7 @@ static int usb_bus_notify(struct notifier_block *nb, unsigned long val,
 	if (r < 0)
 		goto out;
 
-	mutex_lock(&monitor_lock);
-	list_for_each_entry(m, &monitor_list, node)
-		varlink_connection_reply(m->conn, VARLINK_REPLY_CONTINUES, reply);
-	mutex_unlock(&monitor_lock);
+	varlink_topic_publish(usb_topic, reply);
 
 out:
 	json_array_unref(devices);
@@ -342,6 +317,10 @@ static int __init example_init(void)
 	};
 	int r;
 
+	r = varlink_topic_new(&usb_topic);
+	if (r < 0)
+		return r;
+
 	r = varlink_service_new(&s,
 				"org.kernel.example", 0666,
 				THIS_MODULE,
@@ -353,6 +332,10 @@ static int __init example_init(void)
 	if (r < 0)
 		goto out;
 
+	/*
+	 * Not VARLINK_METHOD_CACHE: the host and domain name change with
+	 * sethostname() and setdomainname(), which nothing invalidates on.
+	 */
 	r = varlink_service_register_callback(s,
 					      "org.kernel.sysinfo.GetInfo",
 					      org_kernel_sysinfo_GetInfo, NULL);
@@ -365,6 +348,11 @@ static int __init example_init(void)
 	if (r < 0)
 		return r;
 
+	r = varlink_service_set_method_flags(s, "org.kernel.devices.usb.Info",
+					     VARLINK_METHOD_CACHE);
+	if (r < 0)
+		return r;
+
 	r = varlink_service_register_callback(s,
 					      "org.kernel.devices.usb.Monitor",
 					      org_kernel_devices_usb_Monitor, NULL);
@@ -386,6 +374,7 @@ static void __exit example_exit(void)
 {
 	usb_unregister_notify(&usb_bus_notifier);
 	varlink_service_free(service);
+	varlink_topic_free(usb_topic);
 }
 
 module_init(example_init);
@@ -0,0 +1,156 @@
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE PAGE_SIZE
+#define ARENA_ALIGN sizeof(unsigned long long)
+
+/* Further chunks, the first one holds the arena itself. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	char data[] __aligned(ARENA_ALIGN);
+};
+
+struct arena {
+	refcount_t refcount;
+	struct arena_chunk *chunks;
+
+	/* The free space of the current chunk. */
+	char *p;
+	char *end;
+
+	/* The latest allocation, it can grow in place. */
+	char *last;
+
+	char data[] __aligned(ARENA_ALIGN);
+};
+
+int arena_new(struct arena **arenap)
+{
+	struct arena *arena;
+
+	arena = kmalloc(ARENA_CHUNK_SIZE, GFP_KERNEL);
+	if (!arena)
+		return -ENOMEM;
+
+	refcount_set(&arena->refcount, 1);
+	arena->chunks = NULL;
+	arena->p = arena->data;
+	arena->end = (char *)arena + ARENA_CHUNK_SIZE;
+	arena->last = NULL;
+
+	*arenap = arena;
+	return 0;
+}
+
+struct arena *arena_ref(struct arena *arena)
+{
+	refcount_inc(&arena->refcount);
+	return arena;
+}
+
+struct arena *arena_unref(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (!arena || !refcount_dec_and_test(&arena->refcount))
+		return NULL;
+
+	chunk = arena->chunks;
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+
+		kvfree(chunk);
+		chunk = next;
+	}
+
+	kfree(arena);
+
+	return NULL;
+}
+
+/* Large allocations get a chunk of their own, the current one stays. */
+static void *arena_alloc_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t chunk_size;
+
+	chunk_size = max_t(size_t, sizeof(struct arena_chunk) + size,
+			   ARENA_CHUNK_SIZE);
+	chunk = kvmalloc(chunk_size, GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	if (size <= ARENA_CHUNK_SIZE / 4) {
+		arena->p = chunk->data + ALIGN(size, ARENA_ALIGN);
+		arena->end = (char *)chunk + chunk_size;
+		arena->last = chunk->data;
+	}
+
+	return chunk->data;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	char *p;
+
+	if (size > arena->end - arena->p) {
+		p = arena_alloc_chunk(arena, size);
+		if (!p)
+			return NULL;
+	} else {
+		p = arena->p;
+		arena->p += min_t(size_t, ALIGN(size, ARENA_ALIGN),
+				  arena->end - arena->p);
+		arena->last = p;
+	}
+
+	memset(p, 0, size);
+
+	return p;
+}
+
+/* Grows the latest allocation in place, or moves it. */
+void *arena_realloc(struct arena *arena, void *p, size_t size,
+		    size_t new_size)
+{
+	char *n;
+
+	if (p && p == arena->last &&
+	    new_size <= arena->end - (char *)p) {
+		if (new_size > size)
+			memset((char *)p + size, 0, new_size - size);
+		arena->p = (char *)p + min_t(size_t, ALIGN(new_size, ARENA_ALIGN),
+					     arena->end - (char *)p);
+		return p;
+	}
+
+	n = arena_alloc(arena, new_size);
+	if (!n)
+		return NULL;
+
+	if (p)
+		memcpy(n, p, min(size, new_size));
+
+	return n;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t len)
+{
+	char *p;
+
+	p = arena_alloc(arena, len + 1);
+	if (!p)
+		return NULL;
+
+	memcpy(p, s, len);
+
+	return p;
+}
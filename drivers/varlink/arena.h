@@ -0,0 +1,21 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <linux/types.h>
+
+struct arena;
+
+/*
+ * A bump allocator for the memory of one call, released at once when the
+ * last reference is dropped. Allocations are zeroed and never freed one
+ * by one; only one context allocates at a time.
+ */
+int arena_new(struct arena **arenap);
+struct arena *arena_ref(struct arena *arena);
+struct arena *arena_unref(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_realloc(struct arena *arena, void *p, size_t size,
+		    size_t new_size);
+char *arena_strndup(struct arena *arena, const char *s, size_t len);
+#endif
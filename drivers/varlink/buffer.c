@@ -1,13 +1,37 @@
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uio.h>
 
 #include "buffer.h"
 
-struct buffer {
+/*
+ * A buffer is a chain of segments. The first segment grows by reallocation
+ * until it reaches the size of a page, after that the buffer is extended by
+ * appending further page-sized segments, so that large messages never need
+ * high-order allocations and are never copied when the buffer grows.
+ * Contiguous reservations larger than a page get their own kvmalloc()
+ * segment.
+ */
+#define BUFFER_SEGMENT_SIZE PAGE_SIZE
+
+struct buffer_segment {
+	struct buffer_segment *next;
 	char *data;
 	unsigned int size;
 	unsigned int allocated;
 };
 
+struct buffer {
+	struct buffer_segment first;
+	struct buffer_segment *tail;
+	unsigned int size;
+};
+
 int buffer_new(struct buffer **bufferp, unsigned int initial_alloc)
 {
 	struct buffer *buffer;
@@ -16,57 +40,148 @@ int buffer_new(struct buffer **bufferp, unsigned int initial_alloc)
 	if (!buffer)
 		return -ENOMEM;
 
-	buffer->allocated = initial_alloc;
-	buffer->data = kmalloc(initial_alloc, GFP_KERNEL);
+	buffer->tail = &buffer->first;
+
+	initial_alloc = min_t(unsigned int, initial_alloc, BUFFER_SEGMENT_SIZE);
+	buffer->first.data = kmalloc(initial_alloc, GFP_KERNEL);
+	if (buffer->first.data)
+		buffer->first.allocated = initial_alloc;
 
 	*bufferp = buffer;
 
 	return 0;
 }
 
+static void buffer_free_segments(struct buffer *buffer)
+{
+	struct buffer_segment *segment = buffer->first.next;
+
+	while (segment) {
+		struct buffer_segment *next = segment->next;
+
+		kvfree(segment->data);
+		kfree(segment);
+		segment = next;
+	}
+
+	buffer->first.next = NULL;
+	buffer->tail = &buffer->first;
+}
+
 struct buffer *buffer_free(struct buffer *buffer)
 {
 	if (!buffer)
 		return NULL;
 
-	kfree(buffer->data);
+	buffer_free_segments(buffer);
+	kvfree(buffer->first.data);
 	kfree(buffer);
 
 	return NULL;
 }
 
+void buffer_reset(struct buffer *buffer)
+{
+	buffer_free_segments(buffer);
+	buffer->first.size = 0;
+	buffer->size = 0;
+}
+
 int buffer_steal_data(struct buffer *buffer, char **datap)
 {
 	int size = buffer->size;
+	struct buffer_segment *segment;
+	char *data;
 
-	if (datap)
-		*datap = buffer->data;
+	if (!datap)
+		goto out;
 
-	buffer->data = NULL;
-	buffer->size = 0;
-	buffer->allocated = 0;
+	/* A single segment can be handed out as it is. */
+	if (!buffer->first.next) {
+		*datap = buffer->first.data;
+		buffer->first.data = NULL;
+		buffer->first.allocated = 0;
+		goto out;
+	}
+
+	data = kmalloc(max(size, 1), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	for (segment = &buffer->first; segment; segment = segment->next) {
+		memcpy(data, segment->data, segment->size);
+		data += segment->size;
+	}
+
+	*datap = data - size;
+
+out:
+	buffer_reset(buffer);
 
 	return size;
 }
 
+/* Append a segment which provides at least n contiguous bytes. */
+static int buffer_add_segment(struct buffer *buffer, unsigned int n)
+{
+	struct buffer_segment *segment;
+	unsigned int allocated;
+
+	segment = kzalloc(sizeof(struct buffer_segment), GFP_KERNEL);
+	if (!segment)
+		return -ENOMEM;
+
+	if (n <= BUFFER_SEGMENT_SIZE) {
+		allocated = BUFFER_SEGMENT_SIZE;
+		segment->data = kmalloc(allocated, GFP_KERNEL);
+	} else {
+		allocated = PAGE_ALIGN(n);
+		segment->data = kvmalloc(allocated, GFP_KERNEL);
+	}
+
+	if (!segment->data) {
+		kfree(segment);
+		return -ENOMEM;
+	}
+
+	segment->allocated = allocated;
+	buffer->tail->next = segment;
+	buffer->tail = segment;
+
+	return 0;
+}
+
+/* Ensure that the tail segment has room for n contiguous bytes. */
 static int buffer_ensure_size(struct buffer *buffer, unsigned int n)
 {
+	struct buffer_segment *tail = buffer->tail;
 	unsigned int need;
+	unsigned int allocated;
+	char *data;
 
-	need = buffer->size + n;
+	need = tail->size + n;
+	if (need <= tail->allocated)
+		return 0;
+
+	/* Grow the only segment up to the size of a page. */
+	if (tail == &buffer->first && need <= BUFFER_SEGMENT_SIZE) {
+		allocated = max(tail->allocated, 16U);
+		while (need > allocated)
+			allocated *= 2;
 
-	if (need > buffer->allocated) {
-		do {
-			buffer->allocated *= 2;
-		} while (need > buffer->allocated);
+		allocated = min_t(unsigned int, allocated, BUFFER_SEGMENT_SIZE);
 
-		buffer->data = krealloc(buffer->data, buffer->allocated,
-					GFP_KERNEL);
-		if (!buffer->data)
+		data = krealloc(tail->data, allocated, GFP_KERNEL);
+		if (!data)
 			return -ENOMEM;
+
+		tail->data = data;
+		tail->allocated = allocated;
+
+		return 0;
 	}
 
-	return 0;
+	return buffer_add_segment(buffer, n);
 }
 
 int buffer_printf(struct buffer *buffer, const char *fmt, ...)
@@ -74,17 +189,19 @@ int buffer_printf(struct buffer *buffer, const char *fmt, ...)
 	int r;
 
 	for (;;) {
+		struct buffer_segment *tail = buffer->tail;
 		va_list ap;
 
 		va_start(ap, fmt);
-		r = vsnprintf((char *)buffer->data + buffer->size,
-			      buffer->allocated - buffer->size, fmt, ap);
+		r = vsnprintf(tail->data + tail->size,
+			      tail->allocated - tail->size, fmt, ap);
 		va_end(ap);
 
 		if (r < 0)
 			return r;
 
-		if ((unsigned int)r < buffer->allocated - buffer->size) {
+		if ((unsigned int)r < tail->allocated - tail->size) {
+			tail->size += r;
 			buffer->size += r;
 			break;
 		}
@@ -97,7 +214,36 @@ int buffer_printf(struct buffer *buffer, const char *fmt, ...)
 	return 0;
 }
 
-int buffer_add_nul(struct buffer *buffer)
+int buffer_add(struct buffer *buffer, const void *data, unsigned int size)
+{
+	const char *p = data;
+
+	while (size > 0) {
+		struct buffer_segment *tail = buffer->tail;
+		unsigned int n;
+		int r;
+
+		n = min(size, tail->allocated - tail->size);
+		if (n == 0) {
+			r = buffer_ensure_size(buffer, min_t(unsigned int, size,
+							     BUFFER_SEGMENT_SIZE));
+			if (r < 0)
+				return r;
+
+			continue;
+		}
+
+		memcpy(tail->data + tail->size, p, n);
+		tail->size += n;
+		buffer->size += n;
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+int buffer_add_char(struct buffer *buffer, char c)
 {
 	int r;
 
@@ -105,12 +251,150 @@ int buffer_add_nul(struct buffer *buffer)
 	if (r < 0)
 		return r;
 
-	buffer->data[buffer->size] = '\0';
+	buffer->tail->data[buffer->tail->size++] = c;
 	buffer->size++;
 
 	return 0;
 }
 
+int buffer_add_string(struct buffer *buffer, const char *string)
+{
+	return buffer_add(buffer, string, strlen(string));
+}
+
+int buffer_add_uint(struct buffer *buffer, u64 u)
+{
+	char digits[20];
+	char *p = digits + sizeof(digits);
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u > 0);
+
+	return buffer_add(buffer, p, digits + sizeof(digits) - p);
+}
+
+int buffer_add_int(struct buffer *buffer, s64 i)
+{
+	int r;
+
+	if (i >= 0)
+		return buffer_add_uint(buffer, i);
+
+	r = buffer_add_char(buffer, '-');
+	if (r < 0)
+		return r;
+
+	/* Negate in unsigned arithmetic, S64_MIN has no positive counterpart. */
+	return buffer_add_uint(buffer, -(u64)i);
+}
+
+int buffer_add_nul(struct buffer *buffer)
+{
+	return buffer_add_char(buffer, '\0');
+}
+
+int buffer_reserve(struct buffer *buffer, unsigned int size, char **datap)
+{
+	int r;
+
+	r = buffer_ensure_size(buffer, size);
+	if (r < 0)
+		return r;
+
+	*datap = buffer->tail->data + buffer->tail->size;
+
+	return 0;
+}
+
+int buffer_reserve_keep(struct buffer *buffer, unsigned int keep,
+			unsigned int size, char **datap)
+{
+	struct buffer_segment *tail = buffer->tail;
+	struct buffer_segment *segment;
+	int r;
+
+	r = buffer_ensure_size(buffer, size);
+	if (r < 0)
+		return r;
+
+	/* A grown first segment kept its contents, a new segment did not. */
+	if (buffer->tail != tail) {
+		memcpy(buffer->tail->data, tail->data + tail->size, keep);
+
+		/* An empty segment only held the previous reservation. */
+		if (tail != &buffer->first && tail->size == 0) {
+			for (segment = &buffer->first; segment->next != tail;
+			     segment = segment->next)
+				;
+
+			segment->next = buffer->tail;
+			kvfree(tail->data);
+			kfree(tail);
+		}
+	}
+
+	*datap = buffer->tail->data + buffer->tail->size;
+
+	return 0;
+}
+
+void buffer_commit(struct buffer *buffer, unsigned int size)
+{
+	buffer->tail->size += size;
+	buffer->size += size;
+}
+
+void buffer_copy(struct buffer *buffer, unsigned int offset,
+		 void *data, unsigned int size)
+{
+	struct buffer_segment *segment;
+	char *p = data;
+
+	for (segment = &buffer->first; segment && size > 0;
+	     segment = segment->next) {
+		unsigned int n;
+
+		if (offset >= segment->size) {
+			offset -= segment->size;
+			continue;
+		}
+
+		n = min(size, segment->size - offset);
+		memcpy(p, segment->data + offset, n);
+
+		p += n;
+		size -= n;
+		offset = 0;
+	}
+}
+
+int buffer_copy_to_iter(struct buffer *buffer, unsigned int offset,
+			struct iov_iter *iter, unsigned int size)
+{
+	struct buffer_segment *segment;
+
+	for (segment = &buffer->first; segment && size > 0;
+	     segment = segment->next) {
+		unsigned int n;
+
+		if (offset >= segment->size) {
+			offset -= segment->size;
+			continue;
+		}
+
+		n = min(size, segment->size - offset);
+		if (copy_to_iter(segment->data + offset, n, iter) != n)
+			return -EFAULT;
+
+		size -= n;
+		offset = 0;
+	}
+
+	return 0;
+}
+
 int buffer_size(struct buffer *buffer)
 {
 	if (!buffer)
@@ -118,3 +402,101 @@ int buffer_size(struct buffer *buffer)
 
 	return buffer->size;
 }
+
+/*
+ * Per-CPU pool of empty buffers. A recycled buffer keeps the allocation of
+ * its first segment, at most one page, so it usually serves the next user
+ * without any allocation.
+ */
+#define BUFFER_POOL_SIZE 16
+
+struct buffer_pool {
+	struct buffer *buffers[BUFFER_POOL_SIZE];
+	unsigned int n_buffers;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static DEFINE_PER_CPU(struct buffer_pool, buffer_pool);
+
+int buffer_pool_get(struct buffer **bufferp)
+{
+	struct buffer_pool *pool;
+	struct buffer *buffer = NULL;
+
+	pool = get_cpu_ptr(&buffer_pool);
+	if (pool->n_buffers > 0) {
+		buffer = pool->buffers[--pool->n_buffers];
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	put_cpu_ptr(&buffer_pool);
+
+	if (buffer) {
+		*bufferp = buffer;
+		return 0;
+	}
+
+	return buffer_new(bufferp, 256);
+}
+
+struct buffer *buffer_pool_put(struct buffer *buffer)
+{
+	struct buffer_pool *pool;
+
+	if (!buffer)
+		return NULL;
+
+	buffer_reset(buffer);
+
+	pool = get_cpu_ptr(&buffer_pool);
+	if (pool->n_buffers < BUFFER_POOL_SIZE) {
+		pool->buffers[pool->n_buffers++] = buffer;
+		buffer = NULL;
+	}
+	put_cpu_ptr(&buffer_pool);
+
+	return buffer_free(buffer);
+}
+
+static int buffer_pool_show(struct seq_file *m, void *unused)
+{
+	unsigned long hits = 0;
+	unsigned long misses = 0;
+	unsigned int n_buffers = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct buffer_pool *pool = per_cpu_ptr(&buffer_pool, cpu);
+
+		hits += READ_ONCE(pool->hits);
+		misses += READ_ONCE(pool->misses);
+		n_buffers += READ_ONCE(pool->n_buffers);
+	}
+
+	seq_printf(m, "hits: %lu\n", hits);
+	seq_printf(m, "misses: %lu\n", misses);
+	seq_printf(m, "pooled: %u\n", n_buffers);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(buffer_pool);
+
+void buffer_pool_init(struct dentry *debugfs)
+{
+	debugfs_create_file("buffer_pool", 0444, debugfs, NULL,
+			    &buffer_pool_fops);
+}
+
+void buffer_pool_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct buffer_pool *pool = per_cpu_ptr(&buffer_pool, cpu);
+
+		while (pool->n_buffers > 0)
+			buffer_free(pool->buffers[--pool->n_buffers]);
+	}
+}
@@ -1,13 +1,56 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
+#include <linux/compiler.h>
+#include <linux/types.h>
+
 struct buffer;
+struct dentry;
+struct iov_iter;
 
 int buffer_new(struct buffer **bufferp, unsigned int initial_alloc);
 struct buffer *buffer_free(struct buffer *buffer);
+void buffer_reset(struct buffer *buffer);
 int buffer_printf(struct buffer *buffer, const char *fmt, ...)
 __attribute__ ((format (printf, 2, 3)));
+int buffer_add(struct buffer *buffer, const void *data, unsigned int size);
+int buffer_add_char(struct buffer *buffer, char c);
+int buffer_add_string(struct buffer *buffer, const char *string);
+int buffer_add_int(struct buffer *buffer, s64 i);
+int buffer_add_uint(struct buffer *buffer, u64 u);
 int buffer_add_nul(struct buffer *buffer);
+
+/* Append a string literal without scanning it for its length. */
+#define buffer_add_literal(buffer, literal) \
+	buffer_add(buffer, "" literal, sizeof(literal) - 1)
+
+/*
+ * Returns a pointer to at least @size bytes at the end of the buffer;
+ * buffer_commit() appends the @size bytes actually written to it.
+ */
+int buffer_reserve(struct buffer *buffer, unsigned int size, char **datap);
+void buffer_commit(struct buffer *buffer, unsigned int size);
+
+/*
+ * Like buffer_reserve(), the reserved bytes start with the first @keep
+ * bytes written to the previous reservation, which was not committed.
+ */
+int buffer_reserve_keep(struct buffer *buffer, unsigned int keep,
+			unsigned int size, char **datap);
+
+void buffer_copy(struct buffer *buffer, unsigned int offset,
+		 void *data, unsigned int size);
+
+/* Copies with one copy_to_iter() per segment. */
+int buffer_copy_to_iter(struct buffer *buffer, unsigned int offset,
+			struct iov_iter *iter, unsigned int size);
+
 int buffer_steal_data(struct buffer *buffer, char **datap);
 int buffer_size(struct buffer *buffer);
+
+/* Recycled empty buffers, buffer_pool_put() frees what does not fit. */
+int buffer_pool_get(struct buffer **bufferp);
+struct buffer *buffer_pool_put(struct buffer *buffer);
+void buffer_pool_init(struct dentry *debugfs);
+void buffer_pool_exit(void);
 #endif
@@ -1,131 +1,684 @@
 #include <linux/json.h>
+#include <linux/refcount.h>
 #include <linux/slab.h>
 #include <linux/varlink.h>
+#include <linux/wait_bit.h>
 
+#include "arena.h"
 #include "buffer.h"
 #include "connection.h"
 #include "interface.h"
 #include "json-object.h"
 #include "message.h"
+#include "reply-cache.h"
+#include "topic.h"
+
+static struct kmem_cache *connection_cache;
+
+/* The call is allocated in @arena, and keeps it until it is freed. */
+int varlink_call_new(struct varlink_connection *conn,
+		     struct arena *arena,
+		     struct varlink_call **callp)
+{
+	struct varlink_call *call;
+
+	call = arena_alloc(arena, sizeof(struct varlink_call));
+	if (!call)
+		return -ENOMEM;
+
+	refcount_set(&call->refcount, 1);
+	call->arena = arena_ref(arena);
+	call->conn = varlink_connection_ref(conn);
+
+	*callp = call;
+	return 0;
+}
+
+/*
+ * Builds the parameters of the call, once. Only the context which
+ * dispatches the call allocates from its arena.
+ */
+int varlink_call_parse_parameters(struct varlink_call *call)
+{
+	if (call->parameters)
+		return 0;
+
+	return message_parse_parameters(call->arena, call->parameters_json,
+					&call->parameters);
+}
+
+struct varlink_call *varlink_call_ref(struct varlink_call *call)
+{
+	refcount_inc(&call->refcount);
+	return call;
+}
+EXPORT_SYMBOL(varlink_call_ref);
+
+/*
+ * The active call is finished after its last reply, or, without a pending
+ * stream, once the callback returned and nobody holds a handle of it.
+ * Called with the dispatch lock or conn->lock held.
+ */
+static bool connection_call_finished(struct varlink_connection *conn)
+{
+	struct varlink_call *call = conn->call;
+
+	if (READ_ONCE(conn->running))
+		return false;
+
+	if (atomic_read(&call->replies) == CALL_REPLY_DONE)
+		return true;
+
+	return !(READ_ONCE(conn->flags_reply) & VARLINK_REPLY_CONTINUES) &&
+	       refcount_read(&call->refcount) == 1;
+}
+
+/* Hands a reply to the hook, once; returns false if there is none. */
+static bool call_release_hook(struct varlink_call *call, struct reply *reply)
+{
+	void (*hook)(struct varlink_call *call, struct reply *reply);
+
+	if (!READ_ONCE(call->reply_hook))
+		return false;
+
+	hook = xchg(&call->reply_hook, NULL);
+	if (!hook)
+		return false;
+
+	hook(call, reply);
+	return true;
+}
+
+/*
+ * Dropping a handle of the active call may finish it, readers dispatch the
+ * calls which waited for it. It takes conn->lock and may free the call, so
+ * it must be called in process context.
+ */
+struct varlink_call *varlink_call_unref(struct varlink_call *call)
+{
+	struct varlink_connection *conn;
+	bool last;
+
+	might_sleep();
+
+	if (!call)
+		return NULL;
+
+	conn = call->conn;
+
+	mutex_lock(&conn->lock);
+	last = refcount_dec_and_test(&call->refcount);
+	if (!last && call == conn->call && connection_call_finished(conn))
+		conn->call_finished = true;
+	mutex_unlock(&conn->lock);
+
+	if (!last) {
+		wake_up_interruptible(&conn->waitq);
+		return NULL;
+	}
+
+	call_release_hook(call, NULL);
+
+	if (call->async)
+		atomic_dec(&conn->service->n_queued);
+
+	if (call->member)
+		varlink_interface_unref(call->member->iface);
+
+	reply_unref(call->streaming);
+	json_object_unref(call->parameters);
+	arena_unref(call->arena);
+
+	varlink_connection_unref(conn);
+
+	return NULL;
+}
+EXPORT_SYMBOL(varlink_call_unref);
+
+static void connection_work(struct work_struct *work);
 
 int varlink_connection_new(struct varlink_connection **connp)
 {
 	struct varlink_connection *conn;
 
-	conn = kzalloc(sizeof(struct varlink_connection), GFP_KERNEL);
+	conn = kmem_cache_zalloc(connection_cache, GFP_KERNEL);
 	if (!conn)
 		return -ENOMEM;
 
+	refcount_set(&conn->refcount, 1);
+	conn->call_finished = true;
+	INIT_LIST_HEAD(&conn->calls);
+	INIT_LIST_HEAD(&conn->subscriptions);
+	INIT_WORK(&conn->work, connection_work);
+	reply_queue_init(&conn->replies);
+	mutex_init(&conn->dispatch_lock);
 	mutex_init(&conn->lock);
 	init_waitqueue_head(&conn->waitq);
+	INIT_LIST_HEAD(&conn->uring_cmds);
+	spin_lock_init(&conn->uring_lock);
 
 	*connp = conn;
 	return 0;
 }
 
-struct varlink_connection
-*varlink_connection_free(struct varlink_connection *conn)
+struct varlink_connection *varlink_connection_ref(struct varlink_connection
+						  *conn)
+{
+	refcount_inc(&conn->refcount);
+	return conn;
+}
+EXPORT_SYMBOL(varlink_connection_ref);
+
+/* Every call holds a reference, the memory outlives all handles. */
+struct varlink_connection *varlink_connection_unref(struct varlink_connection
+						    *conn)
+{
+	if (!conn || !refcount_dec_and_test(&conn->refcount))
+		return NULL;
+
+	buffer_pool_put(conn->input);
+	reply_queue_clear(&conn->replies);
+	reply_ring_free(conn->ring);
+	kmem_cache_free(connection_cache, conn);
+
+	return NULL;
+}
+EXPORT_SYMBOL(varlink_connection_unref);
+
+/*
+ * Called when the file is released. Later replies through call handles
+ * are dropped, the connection is freed with the last handle.
+ */
+void varlink_connection_close(struct varlink_connection *conn)
 {
+	struct varlink_call *call, *tmp;
+
+	/* Wait for an asynchronous call, it may dispatch further calls. */
+	cancel_work_sync(&conn->work);
+
+	mutex_lock(&conn->lock);
+	conn->closed = true;
+	call = conn->call;
+	conn->call = NULL;
+	mutex_unlock(&conn->lock);
+
 	if (conn->closed_callback)
 		conn->closed_callback(conn, conn->closed_userdata);
 
-	kfree(conn->method);
+	varlink_topic_connection_closed(conn);
 
-	buffer_free(conn->buffer);
-	kfree(conn);
+	varlink_call_unref(call);
+	list_for_each_entry_safe(call, tmp, &conn->calls, node)
+		varlink_call_unref(call);
+	INIT_LIST_HEAD(&conn->calls);
+	conn->n_calls = 0;
 
-	return NULL;
+	varlink_connection_unref(conn);
 }
 
-static int connection_reply(struct varlink_connection *conn,
-			    const char *error,
-			    long long flags,
-			    struct json_object *parameters)
+/* A provided entry is queued, or handed back. */
+static int connection_queue_reply(struct varlink_connection *conn,
+				  struct reply *reply,
+				  struct reply_entry *entry)
 {
-	struct json_object *reply;
+	if (reply_queue_size(&conn->replies) > 128 * 1024) {
+		WRITE_ONCE(conn->overrun, true);
+		reply_entry_put(entry);
+		return -ENOBUFS;
+	}
+
+	return reply_queue_push(&conn->replies, reply, entry);
+}
+
+/*
+ * Replies are queued without a lock. Once the ring is mapped, pushes take
+ * conn->lock: a reply goes to the ring only while the queue is empty, and
+ * one which does not fit is queued under the same lock, so that no later
+ * reply overtakes it through the ring. A push which did not see the ring
+ * yet can only race with concurrent pushes, which have no order.
+ */
+static int connection_push_reply(struct varlink_connection *conn,
+				 struct reply *reply,
+				 struct reply_entry *entry)
+{
+	struct reply_ring *ring = READ_ONCE(conn->ring);
 	int r;
 
-	if (conn->flags_call & VARLINK_CALL_ONEWAY)
-		return 0;
+	if (!ring)
+		return connection_queue_reply(conn, reply, entry);
+
+	mutex_lock(&conn->lock);
+	r = -ENOSPC;
+	if (reply_queue_length(&conn->replies) == 0)
+		r = reply_ring_push(ring, reply->buffer);
+	if (r < 0)
+		r = connection_queue_reply(conn, reply, entry);
+	else
+		reply_entry_put(entry);
+	mutex_unlock(&conn->lock);
+
+	return r;
+}
+
+/*
+ * Claims the call for a reply, which fails once the last reply claimed it.
+ * The last reply waits until the replies which claimed the call before it
+ * are queued, so that none of them is queued behind it.
+ */
+static int call_enter_reply(struct varlink_call *call, bool last)
+{
+	int state = atomic_read(&call->replies);
+
+	do {
+		if (state & CALL_REPLY_DONE)
+			return -EPROTO;
+	} while (!atomic_try_cmpxchg(&call->replies, &state,
+				     state + 1 + (last ? CALL_REPLY_DONE : 0)));
+
+	if (last)
+		wait_var_event(&call->replies,
+			       atomic_read(&call->replies) ==
+			       CALL_REPLY_DONE + 1);
+
+	return 0;
+}
+
+static void call_exit_reply(struct varlink_call *call)
+{
+	if (atomic_dec_return(&call->replies) == CALL_REPLY_DONE + 1)
+		wake_up_var(&call->replies);
+}
+
+/*
+ * Queues a serialized reply of the call, the first one goes to its hook if
+ * it has one. Replies to a closed connection, or after the last reply of
+ * the call, are dropped. Only the last reply takes conn->lock, to finish
+ * the call. The reply is queued with @entry if it is not NULL, which is
+ * handed back if the reply is not queued. Queueing allocates otherwise,
+ * and the last reply may wait for others; replies are sent in process
+ * context.
+ */
+int varlink_call_push_entry(struct varlink_call *call,
+			    struct reply *reply,
+			    struct reply_entry *entry,
+			    unsigned long long flags)
+{
+	struct varlink_connection *conn = call->conn;
+	bool last = !(flags & VARLINK_REPLY_CONTINUES);
+	int r;
+
+	might_sleep();
+
+	if (READ_ONCE(conn->closed)) {
+		reply_entry_put(entry);
+		return -ENOTCONN;
+	}
+
+	r = call_enter_reply(call, last);
+	if (r < 0) {
+		reply_entry_put(entry);
+		return r;
+	}
+
+	if (call_release_hook(call, reply))
+		reply_entry_put(entry);
+	else
+		r = connection_push_reply(conn, reply, entry);
+	if (r >= 0)
+		WRITE_ONCE(conn->flags_reply, flags);
+
+	call_exit_reply(call);
+
+	if (last) {
+		mutex_lock(&conn->lock);
+		if (call == conn->call)
+			conn->call_finished = true;
+		mutex_unlock(&conn->lock);
+	}
+
+	wake_up_interruptible(&conn->waitq);
+
+	return r;
+}
+
+int varlink_call_push_reply(struct varlink_call *call,
+			    struct reply *reply,
+			    unsigned long long flags)
+{
+	return varlink_call_push_entry(call, reply, NULL, flags);
+}
+
+static int call_check_reply(struct varlink_call *call, long long flags)
+{
+	/* Do not bother to serialize what nobody will read. */
+	if (READ_ONCE(call->conn->closed))
+		return -ENOTCONN;
 
 	if (flags & VARLINK_REPLY_CONTINUES &&
-	    !(conn->flags_call & VARLINK_CALL_MORE))
+	    !(call->flags & VARLINK_CALL_MORE))
 		return -EPROTO;
 
-	r = message_pack_reply(error, parameters, flags, &reply);
+	return 0;
+}
+
+/* Queues a serialized reply, successful last replies may be cached. */
+static int call_queue_reply(struct varlink_call *call,
+			    struct reply *reply,
+			    bool error,
+			    long long flags)
+{
+	int r;
+
+	r = varlink_call_push_reply(call, reply, flags);
+	if (r >= 0 && call->cache_key && !error)
+		reply_cache_store(&call->conn->service->cache, call->cache_key,
+				  reply);
+	reply_unref(reply);
+
+	return r;
+}
+
+static int call_reply(struct varlink_call *call,
+		      const char *error,
+		      long long flags,
+		      struct json_object *parameters)
+{
+	struct reply *reply;
+	int r;
+
+	r = call_check_reply(call, flags);
 	if (r < 0)
 		return r;
 
-	mutex_lock(&conn->lock);
-	if (!conn->buffer) {
-		r = buffer_new(&conn->buffer, 256);
-		if (r < 0)
-			goto out;
-	}
+	if (call->flags & VARLINK_CALL_ONEWAY)
+		return 0;
 
-	if (buffer_size(conn->buffer) > 128 * 1024) {
-		r = -ENOBUFS;
-		conn->overrun = true;
-		goto out;
-	}
+	/* Serialize into a buffer of its own, outside of the lock. */
+	r = message_serialize_reply(error, parameters, flags, &reply);
+	if (r < 0)
+		return r;
+
+	return call_queue_reply(call, reply, error, flags);
+}
+
+int varlink_call_reply(struct varlink_call *call,
+		       long long flags,
+		       struct json_object *parameters)
+{
+	return call_reply(call, NULL, flags, parameters);
+}
+EXPORT_SYMBOL(varlink_call_reply);
+
+int varlink_call_error(struct varlink_call *call,
+		       const char *error,
+		       struct json_object *parameters)
+{
+	struct varlink_service *service = call->conn->service;
+	struct interface_member *member;
+	int idx;
+	int r = 0;
+
+	/* Errors of the method's own interface, or of org.varlink.service. */
+	idx = srcu_read_lock(&service->srcu);
+	member = varlink_service_find_member(service, error, strlen(error),
+					     INTERFACE_MEMBER_ERROR);
+	if (!member)
+		r = -ESRCH;
+	else if (strcmp(member->iface->name, "org.varlink.service") != 0 &&
+		 (!call->member || member->iface != call->member->iface))
+		r = -EINVAL;
+	srcu_read_unlock(&service->srcu, idx);
 
-	r = json_object_write_to_buffer(reply, conn->buffer);
 	if (r < 0)
-		goto out;
+		return r;
+
+	return call_reply(call, error, 0, parameters);
+}
+EXPORT_SYMBOL(varlink_call_error);
+
+/*
+ * Starts a reply whose parameters are written with the returned writer,
+ * straight into the message, instead of being built as an object. The
+ * writer is positioned inside the parameters object; one reply of a call
+ * can be written at a time.
+ */
+int varlink_call_reply_begin(struct varlink_call *call,
+			     long long flags,
+			     struct json_writer **writerp)
+{
+	int r;
 
-	r = buffer_add_nul(conn->buffer);
+	if (call->streaming)
+		return -EBUSY;
+
+	r = call_check_reply(call, flags);
+	if (r < 0)
+		return r;
+
+	r = message_begin_reply(flags, &call->writer, &call->streaming);
+	if (r < 0)
+		return r;
+
+	call->streaming_flags = flags;
+	*writerp = &call->writer;
+
+	return 0;
+}
+EXPORT_SYMBOL(varlink_call_reply_begin);
+
+/*
+ * Finishes and queues the reply. It must be called after every successful
+ * varlink_call_reply_begin(), it returns the first error of the writer and
+ * drops the reply in that case.
+ */
+int varlink_call_reply_end(struct varlink_call *call)
+{
+	struct reply *reply = call->streaming;
+	long long flags = call->streaming_flags;
+	int r;
+
+	if (!reply)
+		return -EPROTO;
+
+	call->streaming = NULL;
+
+	r = message_end_reply(&call->writer, reply);
 	if (r < 0)
 		goto out;
 
-	conn->flags_reply = flags;
-	wake_up_interruptible(&conn->waitq);
+	/* The replies of oneway calls are written for nothing. */
+	if (call->flags & VARLINK_CALL_ONEWAY)
+		goto out;
+
+	return call_queue_reply(call, reply, false, flags);
 
 out:
-	mutex_unlock(&conn->lock);
-	json_object_unref(reply);
+	reply_unref(reply);
 	return r;
 }
+EXPORT_SYMBOL(varlink_call_reply_end);
+
+/*
+ * Returns a new handle of the active call, to reply after the callback
+ * returned. The call stays active until its last reply, or until the last
+ * handle is dropped.
+ */
+struct varlink_call *varlink_connection_get_call(struct varlink_connection
+						 *conn)
+{
+	if (!conn->call)
+		return NULL;
+
+	return varlink_call_ref(conn->call);
+}
+EXPORT_SYMBOL(varlink_connection_get_call);
 
 int varlink_connection_reply(struct varlink_connection *conn,
 				    long long flags,
 				    struct json_object *parameters)
 {
-	return connection_reply(conn, NULL, flags, parameters);
+	if (!conn->call)
+		return -EPROTO;
+
+	return varlink_call_reply(conn->call, flags, parameters);
 }
 EXPORT_SYMBOL(varlink_connection_reply);
 
+int varlink_connection_reply_begin(struct varlink_connection *conn,
+				   long long flags,
+				   struct json_writer **writerp)
+{
+	if (!conn->call)
+		return -EPROTO;
+
+	return varlink_call_reply_begin(conn->call, flags, writerp);
+}
+EXPORT_SYMBOL(varlink_connection_reply_begin);
+
+int varlink_connection_reply_end(struct varlink_connection *conn)
+{
+	if (!conn->call)
+		return -EPROTO;
+
+	return varlink_call_reply_end(conn->call);
+}
+EXPORT_SYMBOL(varlink_connection_reply_end);
+
 int varlink_connection_error(struct varlink_connection *conn,
 			     const char *error,
 			     struct json_object *parameters)
 {
-	struct varlink_interface *iface_error;
-	const char *member_error;
+	if (!conn->call)
+		return -EPROTO;
+
+	return varlink_call_error(conn->call, error, parameters);
+}
+EXPORT_SYMBOL(varlink_connection_error);
+
+int varlink_connection_add_call(struct varlink_connection *conn,
+				struct varlink_call *call)
+{
+	struct varlink_service *service = conn->service;
+
+	lockdep_assert_held(&conn->dispatch_lock);
+
+	if (conn->n_calls >= CONNECTION_PIPELINE_MAX)
+		return -EBUSY;
+
+	/* Unknown methods fail when they are dispatched. */
+	call->member = varlink_service_resolve_method(service, call->method);
+
+	if (call->member &&
+	    READ_ONCE(call->member->method->flags) & VARLINK_METHOD_ASYNC) {
+		if (atomic_inc_return(&service->n_queued) >
+		    READ_ONCE(service->max_queued)) {
+			atomic_dec(&service->n_queued);
+			return -EBUSY;
+		}
+
+		call->async = true;
+	}
+
+	list_add_tail(&call->node, &conn->calls);
+	conn->n_calls++;
+
+	return 0;
+}
+
+/*
+ * Dispatches the pipelined calls in order, until one of them stays active
+ * to stream further replies, or runs asynchronously. Returns the first error
+ * of a callback.
+ */
+/*
+ * Runs the active call. A callback which fails before its last reply
+ * would leave the client waiting, the call is ended with an error; the
+ * interface org.varlink.service has no more specific one.
+ */
+static int connection_dispatch_call(struct varlink_connection *conn)
+{
+	struct varlink_call *call = conn->call;
 	int r;
 
-	r = varlink_service_find_interface(conn->service, error,
-					   &iface_error, &member_error);
-	if (r < 0)
-		return r;
+	r = varlink_service_dispatch_call(conn->service, conn);
+	if (r < 0 && !(atomic_read(&call->replies) & CALL_REPLY_DONE))
+		varlink_call_error(call,
+				   "org.varlink.service.MethodNotImplemented",
+				   NULL);
 
-	r = varlink_interface_find_error(iface_error, member_error);
-	if (r < 0)
-		return r;
+	return r;
+}
+
+int varlink_connection_dispatch(struct varlink_connection *conn)
+{
+	int ret = 0;
+
+	lockdep_assert_held(&conn->dispatch_lock);
+
+	for (;;) {
+		struct varlink_call *call;
+		int r;
+
+		if (conn->call) {
+			if (!connection_call_finished(conn))
+				break;
 
-	if (strcmp(iface_error->name, "org.varlink.service") != 0) {
-		struct varlink_interface *iface_method;
+			mutex_lock(&conn->lock);
+			call = conn->call;
+			conn->call = NULL;
+			conn->call_finished = true;
+			mutex_unlock(&conn->lock);
 
-		r = varlink_service_find_interface(conn->service, conn->method,
-						   &iface_method, NULL);
-		if (r < 0)
-			return r;
+			varlink_call_unref(call);
+		}
 
-		if (strcmp(iface_error->name, iface_method->name) != 0)
-			return -EINVAL;
+		if (list_empty(&conn->calls))
+			break;
+
+		call = list_first_entry(&conn->calls, struct varlink_call, node);
+		list_del(&call->node);
+		conn->n_calls--;
+
+		mutex_lock(&conn->lock);
+		conn->call = call;
+		conn->call_finished = false;
+		conn->flags_reply = 0;
+		mutex_unlock(&conn->lock);
+
+		if (call->async) {
+			WRITE_ONCE(conn->running, true);
+			queue_work(conn->service->wq, &conn->work);
+			break;
+		}
+
+		r = connection_dispatch_call(conn);
+		if (r < 0 && ret == 0)
+			ret = r;
 	}
 
-	return connection_reply(conn, error, 0, parameters);
+	return ret;
+}
+
+/*
+ * Runs an asynchronous call without the dispatch lock, so that writes do
+ * not wait for it; the active call does not change while it is running.
+ * A failure is returned to the client as an error reply.
+ */
+static void connection_work(struct work_struct *work)
+{
+	struct varlink_connection *conn = container_of(work,
+						       struct varlink_connection,
+						       work);
+
+	connection_dispatch_call(conn);
+
+	mutex_lock(&conn->dispatch_lock);
+	WRITE_ONCE(conn->running, false);
+	varlink_connection_dispatch(conn);
+	mutex_unlock(&conn->dispatch_lock);
+
+	wake_up_interruptible(&conn->waitq);
 }
-EXPORT_SYMBOL(varlink_connection_error);
 
 void varlink_connection_set_closed_callback(struct varlink_connection *conn,
 					    void (*callback)(
@@ -138,3 +691,17 @@ void varlink_connection_set_closed_callback(struct varlink_connection *conn,
 	conn->closed_userdata = userdata;
 }
 EXPORT_SYMBOL(varlink_connection_set_closed_callback);
+
+int connection_init(void)
+{
+	connection_cache = KMEM_CACHE(varlink_connection, 0);
+	if (!connection_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void connection_exit(void)
+{
+	kmem_cache_destroy(connection_cache);
+}
@@ -5,19 +5,108 @@
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/varlink.h>
 
+#include "arena.h"
 #include "buffer.h"
+#include "json-writer.h"
+#include "reply.h"
 #include "service.h"
 
+/* Maximum size of a single call message. */
+#define CONNECTION_MESSAGE_MAX (128 * 1024)
+
+/* Maximum number of calls waiting behind the one which is answered. */
+#define CONNECTION_PIPELINE_MAX 64
+
+#define CALL_REPLY_DONE (1 << 30)
+
+/* A call, callbacks can keep a reference to reply later. */
+struct varlink_call {
+	refcount_t refcount;
+	struct varlink_connection *conn;
+	struct list_head node;
+
+	/*
+	 * Holds the call and its envelope. The parameters are parsed from
+	 * their text when they are needed, see varlink_call_parse_parameters().
+	 */
+	struct arena *arena;
+	const char *method;
+	char *parameters_json;
+	struct json_object *parameters;
+	unsigned long long flags;
+
+	/* The resolved method, NULL if it does not exist. */
+	struct interface_member *member;
+
+	/*
+	 * The number of replies being queued, plus CALL_REPLY_DONE once the
+	 * last reply claimed the call. The last reply waits for the others,
+	 * the count is CALL_REPLY_DONE alone when it has been queued.
+	 */
+	atomic_t replies;
+
+	/* Counted against the service's limit of asynchronous calls. */
+	bool async;
+
+	/*
+	 * Takes the first reply instead of the connection's queue, or NULL
+	 * if the call ends without one; claimed with xchg(). An io_uring
+	 * command completes with the reply of its own call.
+	 */
+	void (*reply_hook)(struct varlink_call *call, struct reply *reply);
+	void *reply_hook_data;
+
+	/* Set after a miss in the reply cache, to store the reply; in @arena. */
+	struct reply_cache_key *cache_key;
+
+	/* A reply whose parameters are being written, and its writer. */
+	struct reply *streaming;
+	long long streaming_flags;
+	struct json_writer writer;
+};
+
 struct varlink_connection {
+	/* One for the file, one for every call. */
+	refcount_t refcount;
+	bool closed;
+
 	struct varlink_service *service;
 
-	char *method;
-	unsigned long long flags_call;
+	/*
+	 * The call which is answered, followed by pipelined calls. Calls are
+	 * dispatched one after the other, so replies are in call order.
+	 */
+	struct varlink_call *call;
+	struct list_head calls;
+	unsigned int n_calls;
 	unsigned long long flags_reply;
 
-	struct buffer *buffer;
+	/* The next call can be dispatched, read by waiting readers. */
+	bool call_finished;
+
+	/* Runs the active call if its method is asynchronous. */
+	struct work_struct work;
+	bool running;
+
+	/* Topic subscriptions, ended when the connection is closed. */
+	struct list_head subscriptions;
+
+	/*
+	 * Kept across calls, taken from and returned to the buffer pool. It
+	 * starts with @n_partial bytes of a call which did not end within the
+	 * last write().
+	 */
+	struct buffer *input;
+	unsigned int n_partial;
+
+	/* Replies go to the ring once it is mapped, or to the queue. */
+	struct reply_ring *ring;
+	struct reply_queue replies;
 	bool overrun;
 
 	void (*closed_callback)(
@@ -26,11 +115,35 @@ struct varlink_connection {
 	);
 	void *closed_userdata;
 
+	/* Serializes parsing and dispatching of calls. */
+	struct mutex dispatch_lock;
 	struct mutex lock;
 	wait_queue_head_t waitq;
+
+	/* io_uring commands waiting for replies, woken through waitq. */
+	struct list_head uring_cmds;
+	spinlock_t uring_lock;
+	struct wait_queue_entry uring_wait;
 };
 
+int varlink_call_new(struct varlink_connection *conn,
+		     struct arena *arena,
+		     struct varlink_call **callp);
+int varlink_call_parse_parameters(struct varlink_call *call);
+int varlink_call_push_reply(struct varlink_call *call,
+			    struct reply *reply,
+			    unsigned long long flags);
+int varlink_call_push_entry(struct varlink_call *call,
+			    struct reply *reply,
+			    struct reply_entry *entry,
+			    unsigned long long flags);
+
 int varlink_connection_new(struct varlink_connection **connp);
-struct varlink_connection *varlink_connection_free(struct varlink_connection
-						   *conn);
+void varlink_connection_close(struct varlink_connection *conn);
+int varlink_connection_add_call(struct varlink_connection *conn,
+				struct varlink_call *call);
+int varlink_connection_dispatch(struct varlink_connection *conn);
+
+int connection_init(void);
+void connection_exit(void);
 #endif
@@ -1,4 +1,3 @@
-#include <linux/bsearch.h>
 #include <linux/json.h>
 #include <linux/slab.h>
 #include <linux/sort.h>
@@ -8,14 +7,25 @@
 #include "interface.h"
 #include "scanner.h"
 
-struct varlink_interface *varlink_interface_free(struct varlink_interface
-						 *iface)
+struct varlink_interface *varlink_interface_ref(struct varlink_interface
+						*iface)
+{
+	refcount_inc(&iface->refcount);
+	return iface;
+}
+
+struct varlink_interface *varlink_interface_unref(struct varlink_interface
+						  *iface)
 {
 	unsigned int i;
 
-	if (!iface)
+	if (!iface || !refcount_dec_and_test(&iface->refcount))
 		return NULL;
 
+	for (i = 0; i < iface->n_qualified; i++)
+		kfree(iface->qualified[i].name);
+	kfree(iface->qualified);
+
 	for (i = 0; i < iface->n_members; i++)
 		kfree(iface->members[i]);
 	kfree(iface->members);
@@ -289,6 +299,62 @@ static int interface_read_error(struct varlink_interface *iface,
 	return 0;
 }
 
+static int interface_add_qualified(struct varlink_interface *iface,
+				   unsigned int type,
+				   const char *name,
+				   struct method *method)
+{
+	struct interface_member *member;
+
+	member = &iface->qualified[iface->n_qualified];
+	if (name)
+		member->name = kasprintf(GFP_KERNEL, "%s.%s", iface->name, name);
+	else
+		member->name = kstrdup(iface->name, GFP_KERNEL);
+	if (!member->name)
+		return -ENOMEM;
+
+	member->type = type;
+	member->iface = iface;
+	member->method = method;
+	iface->n_qualified++;
+
+	return 0;
+}
+
+static int interface_qualify(struct varlink_interface *iface)
+{
+	unsigned int i;
+	int r;
+
+	iface->qualified = kcalloc(1 + iface->n_methods + iface->n_errors,
+				   sizeof(struct interface_member), GFP_KERNEL);
+	if (!iface->qualified)
+		return -ENOMEM;
+
+	r = interface_add_qualified(iface, INTERFACE_MEMBER_INTERFACE,
+				    NULL, NULL);
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < iface->n_methods; i++) {
+		r = interface_add_qualified(iface, INTERFACE_MEMBER_METHOD,
+					    iface->methods[i].name,
+					    &iface->methods[i]);
+		if (r < 0)
+			return r;
+	}
+
+	for (i = 0; i < iface->n_errors; i++) {
+		r = interface_add_qualified(iface, INTERFACE_MEMBER_ERROR,
+					    iface->errors[i], NULL);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
 int varlink_interface_new(struct varlink_interface **interfacep,
 			  const char *description)
 {
@@ -296,7 +362,7 @@ int varlink_interface_new(struct varlink_interface **interfacep,
 	struct varlink_interface *iface = NULL;
 	int r;
 
-	r = scanner_new(&scanner, description, true);
+	r = scanner_new(&scanner, NULL, description, true);
 	if (r < 0)
 		return r;
 
@@ -304,6 +370,8 @@ int varlink_interface_new(struct varlink_interface **interfacep,
 	if (!iface)
 		return -ENOMEM;
 
+	refcount_set(&iface->refcount, 1);
+
 	iface->description = kstrdup(description, GFP_KERNEL);
 	if (!iface->description)
 		return -ENOMEM;
@@ -343,79 +411,16 @@ int varlink_interface_new(struct varlink_interface **interfacep,
 	if (r < 0)
 		goto out;
 
+	r = interface_qualify(iface);
+	if (r < 0)
+		goto out;
+
 	*interfacep = iface;
 	iface = NULL;
 
 out:
-	varlink_interface_free(iface);
+	varlink_interface_unref(iface);
 	scanner_free(scanner);
 
 	return r;
 }
-
-int varlink_interface_find_error(struct varlink_interface *iface,
-				 const char *error)
-{
-	if (bsearch(&error, iface->errors, iface->n_errors, sizeof(char *),
-		    members_compare) == NULL)
-		return -ESRCH;
-
-	return 0;
-}
-
-static struct method *interface_find_method(struct varlink_interface *iface,
-					    const char *method)
-{
-	struct method m = {
-		.name = (char *)method,
-	};
-
-	return bsearch(&m, iface->methods, iface->n_methods,
-		       sizeof(struct method), methods_compare);
-}
-
-int varlink_interface_find_method(struct varlink_interface *iface,
-				  const char *method,
-				  int (**callbackp)(
-					  struct varlink_connection *connection,
-					  const char *method,
-					  struct json_object *parameters,
-					  long long flags,
-					  void *userdata
-				  ),
-				  void **userdatap)
-{
-	struct method *m;
-
-	m = interface_find_method(iface, method);
-	if (!m)
-		return -ESRCH;
-
-	*callbackp = m->callback;
-	*userdatap = m->userdata;
-
-	return 0;
-}
-
-int varlink_interface_set_method(struct varlink_interface *iface,
-				 const char *method,
-				 int (*callback)(
-					 struct varlink_connection *connection,
-					 const char *method,
-					 struct json_object *parameters,
-					 long long flags,
-					 void *userdata
-				 ),
-				 void *userdata)
-{
-	struct method *m;
-
-	m = interface_find_method(iface, method);
-	if (!m)
-		return -ESRCH;
-
-	m->callback = callback;
-	m->userdata = userdata;
-
-	return 0;
-}
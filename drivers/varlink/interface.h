@@ -1,10 +1,37 @@
 #ifndef _INTERFACE_H_
 #define _INTERFACE_H_
 
+#include <linux/atomic.h>
 #include <linux/json.h>
+#include <linux/refcount.h>
+#include <linux/types.h>
 #include <linux/varlink.h>
 
+enum {
+	INTERFACE_MEMBER_INTERFACE,
+	INTERFACE_MEMBER_METHOD,
+	INTERFACE_MEMBER_ERROR
+};
+
+/* A fully qualified name of the interface, a method or an error. */
+struct interface_member {
+	struct hlist_node node;
+	char *name;
+	unsigned int type;
+	struct varlink_interface *iface;
+
+	/* The method, for INTERFACE_MEMBER_METHOD. */
+	struct method *method;
+};
+
 struct varlink_interface {
+	/* Queued calls keep a removed interface until they are freed. */
+	refcount_t refcount;
+	bool removed;
+
+	/* Callbacks which are running, removing the interface waits for them. */
+	atomic_t n_running;
+
 	char *name;
 	char *description;
 
@@ -19,6 +46,7 @@ struct varlink_interface {
 			void *userdata
 		);
 		void *userdata;
+		unsigned long flags;
 	} *methods;
 	unsigned int n_methods;
 	unsigned int n_methods_allocated;
@@ -32,34 +60,16 @@ struct varlink_interface {
 	char **members;
 	unsigned int n_members;
 	unsigned int n_members_allocated;
+
+	/* Names to look up calls and errors, hashed by the service. */
+	struct interface_member *qualified;
+	unsigned int n_qualified;
 };
 
 int varlink_interface_new(struct varlink_interface **interfacep,
 			  const char *description);
-struct varlink_interface *varlink_interface_free(struct varlink_interface
-						 *iface);
-
-int varlink_interface_find_error(struct varlink_interface *iface,
-				 const char *error);
-
-int varlink_interface_find_method(struct varlink_interface *iface,
-				  const char *method,
-				  int (**callbackp)(
-					  struct varlink_connection *connection,
-					  const char *method,
-					  struct json_object *parameters,
-					  long long flags,
-					  void *userdata
-				  ),
-				  void **userdatap);
-int varlink_interface_set_method(struct varlink_interface *iface,
-				 const char *method,
-				 int (*callbackp)(
-					 struct varlink_connection *connection,
-					 const char *method,
-					 struct json_object *parameters,
-					 long long flags,
-					 void *userdata
-				 ),
-				 void *userdatap);
+struct varlink_interface *varlink_interface_ref(struct varlink_interface
+						*iface);
+struct varlink_interface *varlink_interface_unref(struct varlink_interface
+						  *iface);
 #endif
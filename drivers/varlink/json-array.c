@@ -1,10 +1,12 @@
+#include <linux/refcount.h>
 #include <linux/slab.h>
 
+#include "arena.h"
 #include "json-array.h"
 #include "json-object.h"
 
 struct json_array {
-	unsigned int refcount;
+	refcount_t refcount;
 	enum json_value_type element_type;
 
 	union json_value *elements;
@@ -12,19 +14,37 @@ struct json_array {
 	unsigned int n_allocated_elements;
 
 	bool writable;
+
+	/* Cached once the array is frozen. */
+	struct json_serialized *serialized;
+
+	/* A parsed array can live in an arena, like an object. */
+	struct arena *arena;
 };
 
+static struct kmem_cache *array_cache;
+
 static int array_append(struct json_array *array, union json_value **valuep)
 {
 	union json_value *v;
 
 	if (array->n_elements == array->n_allocated_elements) {
-		array->n_allocated_elements = max(array->n_allocated_elements * 2, 8U);
-		array->elements = krealloc(array->elements,
-					   array->n_allocated_elements * sizeof(union json_value),
-					   GFP_KERNEL);
-		if (!array->elements)
+		unsigned int n_allocated = max(array->n_allocated_elements * 2, 8U);
+		union json_value *elements;
+
+		if (array->arena)
+			elements = arena_realloc(array->arena, array->elements,
+						 array->n_allocated_elements * sizeof(union json_value),
+						 n_allocated * sizeof(union json_value));
+		else
+			elements = krealloc(array->elements,
+					    n_allocated * sizeof(union json_value),
+					    GFP_KERNEL);
+		if (!elements)
 			return -ENOMEM;
+
+		array->elements = elements;
+		array->n_allocated_elements = n_allocated;
 	}
 
 	v = &array->elements[array->n_elements];
@@ -39,30 +59,41 @@ enum json_value_type json_array_get_element_type(struct json_array *array)
 	return array->element_type;
 }
 
-int json_array_new(struct json_array **arrayp)
+static int array_new(struct json_array **arrayp, struct arena *arena)
 {
 	struct json_array *array;
 
-	array = kzalloc(sizeof(struct json_array), GFP_KERNEL);
+	if (arena)
+		array = arena_alloc(arena, sizeof(struct json_array));
+	else
+		array = kmem_cache_zalloc(array_cache, GFP_KERNEL);
 	if (!array)
 		return -ENOMEM;
 
-	array->refcount = 1;
-	array->writable = true;
+	refcount_set(&array->refcount, 1);
+	array->writable = !arena;
+	array->arena = arena;
 
 	*arrayp = array;
 	return 0;
 }
+
+int json_array_new(struct json_array **arrayp)
+{
+	return array_new(arrayp, NULL);
+}
 EXPORT_SYMBOL(json_array_new);
 
+/* With an arena, like json_object_new_from_scanner(). */
 int json_array_new_from_scanner(struct json_array **arrayp,
 				struct scanner *scanner)
 {
+	struct arena *arena = scanner_get_arena(scanner);
 	struct json_array *array = NULL;
 	bool first = true;
 	int r;
 
-	r = json_array_new(&array);
+	r = array_new(&array, arena);
 	if (r < 0)
 		return r;
 
@@ -107,13 +138,19 @@ int json_array_new_from_scanner(struct json_array **arrayp,
 	array = NULL;
 
 out:
-	json_array_unref(array);
+	/* Arena memory is released with the arena. */
+	if (!arena)
+		json_array_unref(array);
 	return r;
 }
 
 struct json_array *json_array_ref(struct json_array *array)
 {
-	array->refcount++;
+	if (array->arena)
+		arena_ref(array->arena);
+	else
+		refcount_inc(&array->refcount);
+
 	return array;
 }
 EXPORT_SYMBOL(json_array_ref);
@@ -123,22 +160,43 @@ struct json_array *json_array_unref(struct json_array *array)
 	if (!array)
 		return NULL;
 
-	array->refcount--;
+	if (array->arena) {
+		arena_unref(array->arena);
+		return NULL;
+	}
 
-	if (array->refcount == 0) {
+	if (refcount_dec_and_test(&array->refcount)) {
 		unsigned int i;
 
 		for (i = 0; i < array->n_elements; i++)
 			json_value_clear(array->element_type, &array->elements[i]);
 
 		kfree(array->elements);
-		kfree(array);
+		kfree(array->serialized);
+		kmem_cache_free(array_cache, array);
 	}
 
 	return NULL;
 }
 EXPORT_SYMBOL(json_array_unref);
 
+/* Makes the array and all its elements immutable, like json_object_freeze(). */
+struct json_array *json_array_freeze(struct json_array *array)
+{
+	unsigned int i;
+
+	if (!smp_load_acquire(&array->writable))
+		return array;
+
+	for (i = 0; i < array->n_elements; i++)
+		json_value_freeze(array->element_type, &array->elements[i]);
+
+	smp_store_release(&array->writable, false);
+
+	return array;
+}
+EXPORT_SYMBOL(json_array_freeze);
+
 unsigned int json_array_get_n_elements(struct json_array *array)
 {
 	return array->n_elements;
@@ -348,26 +406,21 @@ int json_array_append_object(struct json_array *array,
 }
 EXPORT_SYMBOL(json_array_append_object);
 
-int json_array_write_to_buffer(struct json_array *array, struct buffer *buffer)
+static int array_write(struct json_array *array, struct buffer *buffer)
 {
 	unsigned int i;
 	int r;
 
-	if (array->n_elements == 0) {
-		r = buffer_printf(buffer, "[]");
-		if (r < 0)
-			return r;
-
-		return 0;
-	}
+	if (array->n_elements == 0)
+		return buffer_add_literal(buffer, "[]");
 
-	r = buffer_printf(buffer, "[");
+	r = buffer_add_char(buffer, '[');
 	if (r < 0)
 		return r;
 
 	for (i = 0; i < array->n_elements; i++) {
 		if (i > 0) {
-			r = buffer_printf(buffer, ",");
+			r = buffer_add_char(buffer, ',');
 			if (r < 0)
 				return r;
 		}
@@ -378,5 +431,42 @@ int json_array_write_to_buffer(struct json_array *array, struct buffer *buffer)
 			return r;
 	}
 
-	return buffer_printf(buffer, "]");
+	return buffer_add_char(buffer, ']');
+}
+
+/* A frozen array is serialized once, unless it lives in an arena. */
+int json_array_write_to_buffer(struct json_array *array, struct buffer *buffer)
+{
+	unsigned int offset;
+	int r;
+
+	if (smp_load_acquire(&array->writable) || array->arena)
+		return array_write(array, buffer);
+
+	r = json_serialized_write(&array->serialized, buffer);
+	if (r != -ENOENT)
+		return r;
+
+	offset = buffer_size(buffer);
+	r = array_write(array, buffer);
+	if (r < 0)
+		return r;
+
+	json_serialized_store(&array->serialized, buffer, offset);
+
+	return 0;
+}
+
+int json_array_init(void)
+{
+	array_cache = KMEM_CACHE(json_array, 0);
+	if (!array_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void json_array_exit(void)
+{
+	kmem_cache_destroy(array_cache);
 }
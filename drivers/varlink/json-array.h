@@ -13,4 +13,7 @@ int json_array_get_value(struct json_array *array, unsigned int index,
 			 union json_value **valuep);
 enum json_value_type json_array_get_element_type(struct json_array *array);
 int json_array_write_to_buffer(struct json_array *array, struct buffer *buffer);
+
+int json_array_init(void);
+void json_array_exit(void);
 #endif
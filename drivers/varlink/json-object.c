@@ -1,8 +1,9 @@
 #include <linux/bsearch.h>
+#include <linux/refcount.h>
 #include <linux/slab.h>
-#include <linux/sort.h>
 #include <linux/string.h>
 
+#include "arena.h"
 #include "buffer.h"
 #include "json-array.h"
 #include "json-object.h"
@@ -15,14 +16,29 @@ struct json_field {
 };
 
 struct json_object {
-	unsigned int refcount;
+	refcount_t refcount;
 
 	struct json_field **fields;
 	unsigned int n_fields;
 	unsigned int n_fields_allocated;
 	bool writable;
+
+	/* Cached once the object is frozen. */
+	struct json_serialized *serialized;
+
+	/*
+	 * A parsed object can live in an arena. It is read-only, and its
+	 * references are references of the arena.
+	 */
+	struct arena *arena;
 };
 
+static struct kmem_cache *object_cache;
+static struct kmem_cache *field_cache;
+
+/* Frozen, shared by all calls without parameters. */
+static struct json_object *empty_object;
+
 static int fields_compare(const void *p1, const void *p2)
 {
 	struct json_field *f1 = *(struct json_field **)p1;
@@ -56,85 +72,137 @@ static struct json_field *field_free(struct json_field *field)
 
 	kfree(field->name);
 	json_value_clear(field->type, &field->value);
-	kfree(field);
+	kmem_cache_free(field_cache, field);
 
 	return NULL;
 }
 
-static int object_insert(struct json_object *object,
-			 const char *name,
-			 struct json_field **fieldp)
+static void object_free_name(struct json_object *object, char *name)
 {
-	struct json_field *field;
-	struct json_field **fp;
-	int r = 0;
-
-	field = kzalloc(sizeof(struct json_field), GFP_KERNEL);
-	if (!field)
-		return -ENOMEM;
-
-	field->name = kstrdup(name, GFP_KERNEL);
-	if (!field->name) {
-		r = -ENOMEM;
-		goto out;
-	}
-
-	/* Replace field */
-	fp = bsearch(&field, object->fields, object->n_fields,
-		     sizeof(struct json_field *), fields_compare);
-	if (fp) {
-		unsigned int index = fp - object->fields;
+	if (!object->arena)
+		kfree(name);
+}
 
-		field_free(object->fields[index]);
-		object->fields[index] = field;
-		*fieldp = field;
+/*
+ * Adds or replaces a field, keeping the fields sorted by name. It takes
+ * @name, which is allocated like the object.
+ */
+static int object_add_field(struct json_object *object,
+			    char *name,
+			    struct json_field **fieldp)
+{
+	struct json_field *field;
+	unsigned int lo = 0;
+	unsigned int hi = object->n_fields;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		int c = strcmp(object->fields[mid]->name, name);
+
+		if (c == 0) {
+			field = object->fields[mid];
+			if (!object->arena)
+				json_value_clear(field->type, &field->value);
+			memset(&field->value, 0, sizeof(field->value));
+			object_free_name(object, name);
+
+			*fieldp = field;
+			return 0;
+		}
 
-		return 0;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	/* Insert field */
 	if (object->n_fields == object->n_fields_allocated) {
-		object->n_fields_allocated = max(object->n_fields_allocated * 2, 4U);
-		object->fields = krealloc(object->fields,
-					  object->n_fields_allocated * sizeof(void *),
+		unsigned int n_allocated = max(object->n_fields_allocated * 2, 4U);
+		struct json_field **fields;
+
+		if (object->arena)
+			fields = arena_realloc(object->arena, object->fields,
+					       object->n_fields_allocated * sizeof(void *),
+					       n_allocated * sizeof(void *));
+		else
+			fields = krealloc(object->fields,
+					  n_allocated * sizeof(void *),
 					  GFP_KERNEL);
-		if (!object->fields) {
-			r = -ENOMEM;
-			goto out;
-		}
+		if (!fields)
+			goto fail;
+
+		object->fields = fields;
+		object->n_fields_allocated = n_allocated;
 	}
 
-	object->fields[object->n_fields++] = field;
+	if (object->arena)
+		field = arena_alloc(object->arena, sizeof(struct json_field));
+	else
+		field = kmem_cache_zalloc(field_cache, GFP_KERNEL);
+	if (!field)
+		goto fail;
+
+	field->name = name;
+
+	memmove(object->fields + lo + 1, object->fields + lo,
+		(object->n_fields - lo) * sizeof(void *));
+	object->fields[lo] = field;
+	object->n_fields++;
+
 	*fieldp = field;
-	field = NULL;
+	return 0;
 
-	sort(object->fields, object->n_fields, sizeof(struct json_field *),
-	     fields_compare, NULL);
+fail:
+	object_free_name(object, name);
+	return -ENOMEM;
+}
 
-out:
-	field_free(field);
-	return r;
+static int object_insert(struct json_object *object,
+			 const char *name,
+			 struct json_field **fieldp)
+{
+	char *field_name;
+
+	field_name = kstrdup(name, GFP_KERNEL);
+	if (!field_name)
+		return -ENOMEM;
+
+	return object_add_field(object, field_name, fieldp);
 }
 
-int json_object_new(struct json_object **objectp)
+static int object_new(struct json_object **objectp, struct arena *arena)
 {
-	struct json_object *object = NULL;
+	struct json_object *object;
 
-	object = kzalloc(sizeof(struct json_object), GFP_KERNEL);
+	if (arena)
+		object = arena_alloc(arena, sizeof(struct json_object));
+	else
+		object = kmem_cache_zalloc(object_cache, GFP_KERNEL);
 	if (!object)
 		return -ENOMEM;
 
-	object->refcount = 1;
-	object->writable = true;
+	refcount_set(&object->refcount, 1);
+	object->writable = !arena;
+	object->arena = arena;
 
 	*objectp = object;
 	return 0;
 }
+
+int json_object_new(struct json_object **objectp)
+{
+	return object_new(objectp, NULL);
+}
 EXPORT_SYMBOL(json_object_new);
 
+/*
+ * With an arena, the objects are allocated in it and hold no references
+ * of their own.
+ */
 int json_object_new_from_scanner(struct json_object **objectp,
 				 struct scanner *scanner)
 {
+	struct arena *arena = scanner_get_arena(scanner);
 	struct json_object *object = NULL;
 	bool first = true;
 	int r;
@@ -142,12 +210,13 @@ int json_object_new_from_scanner(struct json_object **objectp,
 	if (scanner_read_operator(scanner, "{") < 0)
 		return -EINVAL;
 
-	r = json_object_new(&object);
+	r = object_new(&object, arena);
 	if (r < 0)
 		return r;
 
 	while (scanner_peek(scanner) != '}') {
-		char *name = NULL;
+		struct json_field *field;
+		char *name;
 
 		if (!first && scanner_read_operator(scanner, ",") < 0) {
 			r = -EINVAL;
@@ -155,35 +224,29 @@ int json_object_new_from_scanner(struct json_object **objectp,
 		}
 
 		r = scanner_read_string(scanner, &name);
-		if (r < 0) {
-			kfree(name);
+		if (r < 0)
 			goto out;
-		}
 
 		if (scanner_read_operator(scanner, ":") < 0) {
+			object_free_name(object, name);
 			r = -EINVAL;
-			kfree(name);
 			goto out;
 		}
 
 		/* treat `null` the same as non-existent keys */
-		if (scanner_read_keyword(scanner, "null") < 0) {
-			struct json_field *field;
-
-			r = object_insert(object, name, &field);
-			if (r < 0) {
-				kfree(name);
+		if (scanner_read_keyword(scanner, "null") >= 0) {
+			object_free_name(object, name);
+		} else {
+			r = object_add_field(object, name, &field);
+			if (r < 0)
 				goto out;
-			}
 
-			r = json_value_read_from_scanner(&field->type, &field->value, scanner);
-			if (r < 0) {
-				kfree(name);
+			r = json_value_read_from_scanner(&field->type,
+							 &field->value, scanner);
+			if (r < 0)
 				goto out;
-			}
 		}
 
-		kfree(name);
 		first = false;
 	}
 
@@ -196,43 +259,82 @@ int json_object_new_from_scanner(struct json_object **objectp,
 	object = NULL;
 
 out:
-	json_object_unref(object);
+	/* Arena memory is released with the arena. */
+	if (!arena)
+		json_object_unref(object);
 	return r;
 }
 
-int json_object_new_from_string(struct json_object **objectp,
-				const char *string)
+/* Parses a whole object from @scanner and frees the scanner. */
+static int object_parse(struct json_object **objectp, struct scanner *scanner)
 {
 	struct json_object *object = NULL;
-	struct scanner *scanner = NULL;
 	int r;
 
-	r = scanner_new(&scanner, string, false);
-	if (r < 0)
-		return r;
-
 	r = json_object_new_from_scanner(&object, scanner);
 	if (r < 0)
 		goto out;
 
 	if (scanner_peek(scanner) != '\0') {
 		r = -EINVAL;
+		if (!scanner_get_arena(scanner))
+			json_object_unref(object);
 		goto out;
 	}
 
 	*objectp = object;
-	object = NULL;
 
 out:
-	json_object_unref(object);
 	scanner_free(scanner);
 	return r;
 }
+
+int json_object_new_from_string(struct json_object **objectp,
+				const char *string)
+{
+	struct scanner *scanner;
+	int r;
+
+	r = scanner_new(&scanner, NULL, string, false);
+	if (r < 0)
+		return r;
+
+	return object_parse(objectp, scanner);
+}
 EXPORT_SYMBOL(json_object_new_from_string);
 
+/*
+ * Parses @string into @arena, the returned object holds a reference of
+ * the arena. @string belongs to the arena, its strings are decoded in
+ * place and the object points into it.
+ */
+int json_object_new_in_arena(struct json_object **objectp,
+			     struct arena *arena,
+			     char *string)
+{
+	struct scanner *scanner;
+	int r;
+
+	r = scanner_new_in_situ(&scanner, arena, string);
+	if (r < 0)
+		return r;
+
+	r = object_parse(objectp, scanner);
+	if (r < 0)
+		return r;
+
+	arena_ref(arena);
+
+	return 0;
+}
+
 struct json_object *json_object_ref(struct json_object *object)
 {
-	object->refcount++;
+	if (object->arena)
+		arena_ref(object->arena);
+	else
+		refcount_inc(&object->refcount);
+
 	return object;
 }
 EXPORT_SYMBOL(json_object_ref);
@@ -242,22 +344,49 @@ struct json_object *json_object_unref(struct json_object *object)
 	if (!object)
 		return NULL;
 
-	object->refcount--;
+	if (object->arena) {
+		arena_unref(object->arena);
+		return NULL;
+	}
 
-	if (object->refcount == 0) {
+	if (refcount_dec_and_test(&object->refcount)) {
 		unsigned int i;
 
 		for (i = 0; i < object->n_fields; i++)
 			field_free(object->fields[i]);
 
 		kfree(object->fields);
-		kfree(object);
+		kfree(object->serialized);
+		kmem_cache_free(object_cache, object);
 	}
 
 	return NULL;
 }
 EXPORT_SYMBOL(json_object_unref);
 
+/*
+ * Makes the object and all objects and arrays it contains immutable. A
+ * frozen tree can be shared by any number of readers and replies without
+ * locking.
+ */
+struct json_object *json_object_freeze(struct json_object *object)
+{
+	unsigned int i;
+
+	if (!smp_load_acquire(&object->writable))
+		return object;
+
+	for (i = 0; i < object->n_fields; i++)
+		json_value_freeze(object->fields[i]->type,
+				  &object->fields[i]->value);
+
+	/* Readers which see the object frozen see its contents frozen. */
+	smp_store_release(&object->writable, false);
+
+	return object;
+}
+EXPORT_SYMBOL(json_object_freeze);
+
 unsigned int json_object_get_field_names(struct json_object *object,
 					 const char ***namesp)
 {
@@ -470,55 +599,74 @@ int json_object_set_object(struct json_object *object, const char *field_name,
 }
 EXPORT_SYMBOL(json_object_set_object);
 
-int json_object_write_to_buffer(struct json_object *object,
-				struct buffer *buffer)
+static int object_write(struct json_object *object, struct buffer *buffer)
 {
-	unsigned int n_fields;
-	const char **field_names = NULL;
 	unsigned int i;
 	int r;
 
-	n_fields = json_object_get_field_names(object, &field_names);
-
-	if (n_fields == 0) {
-		r = buffer_printf(buffer, "{}");
-		goto out;
-	}
+	if (object->n_fields == 0)
+		return buffer_add_literal(buffer, "{}");
 
-	r = buffer_printf(buffer, "{");
+	r = buffer_add_char(buffer, '{');
 	if (r < 0)
 		return r;
 
-	for (i = 0; i < n_fields; i++) {
-		struct json_field *field;
+	/* The fields are kept sorted by name. */
+	for (i = 0; i < object->n_fields; i++) {
+		struct json_field *field = object->fields[i];
 
 		if (i != 0) {
-			r = buffer_printf(buffer, ",");
+			r = buffer_add_char(buffer, ',');
 			if (r < 0)
-				goto out;
+				return r;
 		}
 
-		r = buffer_printf(buffer, "\"%s\":", field_names[i]);
+		r = buffer_add_char(buffer, '"');
 		if (r < 0)
-			goto out;
+			return r;
 
-		field = object_search_field(object, field_names[i]);
-		if (!field) {
-			r = -ENOENT;
-			goto out;
-		}
+		r = json_write_string(buffer, field->name);
+		if (r < 0)
+			return r;
+
+		r = buffer_add_literal(buffer, "\":");
+		if (r < 0)
+			return r;
 
 		r = json_value_write_to_buffer(field->type, &field->value,
 					       buffer);
 		if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = buffer_printf(buffer, "}");
+	return buffer_add_char(buffer, '}');
+}
 
-out:
-	kfree(field_names);
-	return r;
+/*
+ * A frozen object is serialized once, later writes copy the bytes. Objects
+ * in an arena are not worth it, they live for one call.
+ */
+int json_object_write_to_buffer(struct json_object *object,
+				struct buffer *buffer)
+{
+	unsigned int offset;
+	int r;
+
+	if (smp_load_acquire(&object->writable) || object->arena)
+		return object_write(object, buffer);
+
+	r = json_serialized_write(&object->serialized, buffer);
+	if (r != -ENOENT)
+		return r;
+
+	offset = buffer_size(buffer);
+	r = object_write(object, buffer);
+	if (r < 0)
+		return r;
+
+	json_serialized_store(&object->serialized, buffer, offset);
+
+	return 0;
 }
 
 int json_object_to_string(struct json_object *object, char **stringp)
@@ -534,10 +682,52 @@ int json_object_to_string(struct json_object *object, char **stringp)
 	if (r < 0)
 		goto out;
 
-	r = buffer_steal_data(buffer, stringp);
+	r = buffer_add_nul(buffer);
+	if (r < 0)
+		goto out;
+
+	/* Return the length of the string, without the terminating NUL. */
+	r = buffer_steal_data(buffer, stringp) - 1;
 
 out:
 	buffer_free(buffer);
 	return r;
 }
 EXPORT_SYMBOL(json_object_to_string);
+
+/* Returns a reference of the shared empty object, which is read-only. */
+struct json_object *json_object_empty(void)
+{
+	return json_object_ref(empty_object);
+}
+
+int json_object_init(void)
+{
+	object_cache = KMEM_CACHE(json_object, 0);
+	if (!object_cache)
+		return -ENOMEM;
+
+	field_cache = KMEM_CACHE(json_field, 0);
+	if (!field_cache)
+		goto err_object;
+
+	if (json_object_new(&empty_object) < 0)
+		goto err_field;
+
+	json_object_freeze(empty_object);
+
+	return 0;
+
+err_field:
+	kmem_cache_destroy(field_cache);
+err_object:
+	kmem_cache_destroy(object_cache);
+	return -ENOMEM;
+}
+
+void json_object_exit(void)
+{
+	json_object_unref(empty_object);
+	kmem_cache_destroy(field_cache);
+	kmem_cache_destroy(object_cache);
+}
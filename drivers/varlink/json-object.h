@@ -6,9 +6,19 @@
 #include "buffer.h"
 #include "scanner.h"
 
+struct arena;
+
 int json_object_new_from_scanner(struct json_object **objectp,
 				 struct scanner *scanner);
+int json_object_new_in_arena(struct json_object **objectp,
+			     struct arena *arena,
+			     char *string);
 int json_object_write_json(struct json_object *object, struct buffer *buffer);
 int json_object_write_to_buffer(struct json_object *object,
 				struct buffer *buffer);
+
+struct json_object *json_object_empty(void);
+
+int json_object_init(void);
+void json_object_exit(void);
 #endif
@@ -1,4 +1,7 @@
+#include <linux/kernel.h>
+#include <linux/overflow.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
 #include "json-array.h"
 #include "json-object.h"
@@ -27,6 +30,59 @@ void json_value_clear(enum json_value_type type, union json_value *value)
 	}
 }
 
+void json_value_freeze(enum json_value_type type, union json_value *value)
+{
+	switch (type) {
+	case JSON_TYPE_BOOL:
+	case JSON_TYPE_INT:
+	case JSON_TYPE_STRING:
+		break;
+
+	case JSON_TYPE_ARRAY:
+		if (value->array)
+			json_array_freeze(value->array);
+		break;
+
+	case JSON_TYPE_OBJECT:
+		if (value->object)
+			json_object_freeze(value->object);
+		break;
+	}
+}
+
+/* Appends the cached serialization; returns -ENOENT if there is none yet. */
+int json_serialized_write(struct json_serialized **serializedp,
+			  struct buffer *buffer)
+{
+	struct json_serialized *serialized = smp_load_acquire(serializedp);
+
+	if (!serialized)
+		return -ENOENT;
+
+	return buffer_add(buffer, serialized->data, serialized->size);
+}
+
+/*
+ * Caches what was written to @buffer after @offset. Concurrent writers
+ * may both serialize, only the first one publishes its copy.
+ */
+void json_serialized_store(struct json_serialized **serializedp,
+			   struct buffer *buffer, unsigned int offset)
+{
+	struct json_serialized *serialized;
+	unsigned int size = buffer_size(buffer) - offset;
+
+	serialized = kmalloc(struct_size(serialized, data, size), GFP_KERNEL);
+	if (!serialized)
+		return;
+
+	serialized->size = size;
+	buffer_copy(buffer, offset, serialized->data, size);
+
+	if (cmpxchg_release(serializedp, NULL, serialized) != NULL)
+		kfree(serialized);
+}
+
 int json_value_read_from_scanner(enum json_value_type *typep,
 				 union json_value *value, struct scanner *scanner)
 {
@@ -62,7 +118,7 @@ int json_value_read_from_scanner(enum json_value_type *typep,
 
 		*typep = JSON_TYPE_STRING;
 
-	} else if (scanner_read_number(scanner, &number)) {
+	} else if (scanner_read_number(scanner, &number) >= 0) {
 		value->i = number;
 		*typep = JSON_TYPE_INT;
 
@@ -72,67 +128,78 @@ int json_value_read_from_scanner(enum json_value_type *typep,
 	return 0;
 }
 
-static int json_write_string(struct buffer *buffer, const char *s)
+int json_write_string(struct buffer *buffer, const char *s)
 {
+	const char *run = s;
 	int r;
 
-	while (*s != '\0') {
-		switch(*s) {
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		const char *escape;
+		char *p;
+
+		switch (c) {
 		case '\"':
-			r = buffer_printf(buffer, "\\\"");
-			if (r < 0)
-				return r;
+			escape = "\\\"";
 			break;
 
 		case '\\':
-			r = buffer_printf(buffer, "\\\\");
-			if (r < 0)
-				return r;
+			escape = "\\\\";
 			break;
 
 		case '\b':
-			r = buffer_printf(buffer, "\\b");
-			if (r < 0)
-				return r;
+			escape = "\\b";
 			break;
 
 		case '\f':
-			r = buffer_printf(buffer, "\\f");
-			if (r < 0)
-				return r;
+			escape = "\\f";
 			break;
 
 		case '\n':
-			r = buffer_printf(buffer, "\\n");
-			if (r < 0)
-				return r;
+			escape = "\\n";
 			break;
 
 		case '\r':
-			r = buffer_printf(buffer, "\\r");
-			if (r < 0)
-				return r;
+			escape = "\\r";
 			break;
 
 		case '\t':
-			r = buffer_printf(buffer, "\\t");
-			if (r < 0)
-				return r;
+			escape = "\\t";
 			break;
 
 		default:
-			if (*(unsigned char *)s < 0x20)
-				r = buffer_printf(buffer, "\\u%04x", *s);
-			else
-				r = buffer_printf(buffer, "%c", *s);
+			if (c >= 0x20)
+				continue;
+
+			escape = NULL;
+		}
+
+		/* Copy the run of characters which do not need escaping. */
+		r = buffer_add(buffer, run, s - run);
+		if (r < 0)
+			return r;
+
+		run = s + 1;
+
+		if (escape) {
+			r = buffer_add(buffer, escape, 2);
 			if (r < 0)
 				return r;
+
+			continue;
 		}
 
-		s++;
+		r = buffer_reserve(buffer, 6, &p);
+		if (r < 0)
+			return r;
+
+		memcpy(p, "\\u00", 4);
+		p[4] = hex_asc_hi(c);
+		p[5] = hex_asc_lo(c);
+		buffer_commit(buffer, 6);
 	}
 
-	return 0;
+	return buffer_add(buffer, run, s - run);
 }
 
 int json_value_write_to_buffer(enum json_value_type type,
@@ -143,19 +210,22 @@ int json_value_write_to_buffer(enum json_value_type type,
 
 	switch (type) {
 	case JSON_TYPE_BOOL:
-		r = buffer_printf(buffer, "%s", value->b ? "true" : "false");
+		if (value->b)
+			r = buffer_add_literal(buffer, "true");
+		else
+			r = buffer_add_literal(buffer, "false");
 		if (r < 0)
 			return r;
 		break;
 
 	case JSON_TYPE_INT:
-		r = buffer_printf(buffer, "%lld", value->i);
+		r = buffer_add_int(buffer, value->i);
 		if (r < 0)
 			return r;
 		break;
 
 	case JSON_TYPE_STRING:
-		r = buffer_printf(buffer, "\"");
+		r = buffer_add_char(buffer, '"');
 		if (r < 0)
 			return r;
 
@@ -163,7 +233,7 @@ int json_value_write_to_buffer(enum json_value_type type,
 		if (r < 0)
 			return r;
 
-		r = buffer_printf(buffer, "\"");
+		r = buffer_add_char(buffer, '"');
 		if (r < 0)
 			return r;
 		break;
@@ -183,3 +253,72 @@ int json_value_write_to_buffer(enum json_value_type type,
 
 	return 0;
 }
+
+static int value_skip(struct scanner *scanner, unsigned int depth)
+{
+	long long number;
+	const char *close;
+	bool object;
+	bool first = true;
+	int r;
+
+	switch (scanner_peek(scanner)) {
+	case '{':
+		object = true;
+		close = "}";
+		break;
+
+	case '[':
+		object = false;
+		close = "]";
+		break;
+
+	case '"':
+		return scanner_skip_string(scanner);
+
+	default:
+		if (scanner_read_keyword(scanner, "true") >= 0 ||
+		    scanner_read_keyword(scanner, "false") >= 0 ||
+		    scanner_read_keyword(scanner, "null") >= 0 ||
+		    scanner_read_number(scanner, &number) >= 0)
+			return 0;
+
+		return -EINVAL;
+	}
+
+	if (depth == JSON_VALUE_SKIP_DEPTH_MAX)
+		return -EINVAL;
+
+	scanner_read_operator(scanner, object ? "{" : "[");
+
+	while (scanner_peek(scanner) != close[0]) {
+		if (!first && scanner_read_operator(scanner, ",") < 0)
+			return -EINVAL;
+
+		if (object) {
+			r = scanner_skip_string(scanner);
+			if (r < 0)
+				return r;
+
+			if (scanner_read_operator(scanner, ":") < 0)
+				return -EINVAL;
+		}
+
+		r = value_skip(scanner, depth + 1);
+		if (r < 0)
+			return r;
+
+		first = false;
+	}
+
+	return scanner_read_operator(scanner, close);
+}
+
+/*
+ * Steps over a value, checking its syntax without building it. Element
+ * types of arrays are not checked.
+ */
+int json_value_skip(struct scanner *scanner)
+{
+	return value_skip(scanner, 0);
+}
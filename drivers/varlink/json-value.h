@@ -23,9 +23,27 @@ union json_value {
 	struct json_object *object;
 };
 
+/* The serialization of a frozen object or array, computed once. */
+struct json_serialized {
+	unsigned int size;
+	char data[];
+};
+
+int json_serialized_write(struct json_serialized **serializedp,
+			  struct buffer *buffer);
+void json_serialized_store(struct json_serialized **serializedp,
+			   struct buffer *buffer, unsigned int offset);
+
 int json_value_read_from_scanner(enum json_value_type *typep,
 				 union json_value *value, struct scanner *scanner);
+
+/* Skipped values are untrusted input, deeper nesting fails with -EINVAL. */
+#define JSON_VALUE_SKIP_DEPTH_MAX 32
+int json_value_skip(struct scanner *scanner);
+
+int json_write_string(struct buffer *buffer, const char *s);
 int json_value_write_to_buffer(enum json_value_type, union json_value *value,
 			       struct buffer *buffer);
 void json_value_clear(enum json_value_type type, union json_value *value);
+void json_value_freeze(enum json_value_type type, union json_value *value);
 #endif
@@ -0,0 +1,254 @@
+#include <linux/bits.h>
+#include <linux/errno.h>
+#include <linux/export.h>
+
+#include "json-value.h"
+#include "json-writer.h"
+
+void json_writer_init(struct json_writer *writer, struct buffer *buffer)
+{
+	writer->buffer = buffer;
+	writer->depth = 0;
+	writer->objects = 0;
+	writer->nonempty = 0;
+	writer->key = false;
+	writer->error = 0;
+}
+
+/* Returns the sticky error, or -EINVAL if a container is still open. */
+int json_writer_finish(struct json_writer *writer)
+{
+	if (writer->error < 0)
+		return writer->error;
+
+	if (writer->depth > 0 || writer->key)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int writer_fail(struct json_writer *writer, int r)
+{
+	writer->error = r;
+	return r;
+}
+
+static bool writer_in_object(struct json_writer *writer)
+{
+	return writer->depth > 0 &&
+	       writer->objects & BIT(writer->depth - 1);
+}
+
+/* Separates an element of an array, or checks for the key of a field. */
+static int writer_begin_value(struct json_writer *writer)
+{
+	u32 level;
+	int r;
+
+	if (writer->error < 0)
+		return writer->error;
+
+	if (writer->depth == 0)
+		return 0;
+
+	if (writer_in_object(writer)) {
+		if (!writer->key)
+			return writer_fail(writer, -EINVAL);
+
+		writer->key = false;
+		return 0;
+	}
+
+	level = BIT(writer->depth - 1);
+	if (writer->nonempty & level) {
+		r = buffer_add_char(writer->buffer, ',');
+		if (r < 0)
+			return writer_fail(writer, r);
+	}
+	writer->nonempty |= level;
+
+	return 0;
+}
+
+static int writer_begin(struct json_writer *writer, bool object)
+{
+	int r;
+
+	r = writer_begin_value(writer);
+	if (r < 0)
+		return r;
+
+	if (writer->depth == JSON_WRITER_DEPTH_MAX)
+		return writer_fail(writer, -E2BIG);
+
+	r = buffer_add_char(writer->buffer, object ? '{' : '[');
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	writer->depth++;
+	if (object)
+		writer->objects |= BIT(writer->depth - 1);
+	else
+		writer->objects &= ~BIT(writer->depth - 1);
+	writer->nonempty &= ~BIT(writer->depth - 1);
+
+	return 0;
+}
+
+static int writer_end(struct json_writer *writer, bool object)
+{
+	int r;
+
+	if (writer->error < 0)
+		return writer->error;
+
+	if (writer->depth == 0 || writer_in_object(writer) != object ||
+	    writer->key)
+		return writer_fail(writer, -EINVAL);
+
+	r = buffer_add_char(writer->buffer, object ? '}' : ']');
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	writer->depth--;
+
+	return 0;
+}
+
+int json_writer_begin_object(struct json_writer *writer)
+{
+	return writer_begin(writer, true);
+}
+EXPORT_SYMBOL(json_writer_begin_object);
+
+int json_writer_end_object(struct json_writer *writer)
+{
+	return writer_end(writer, true);
+}
+EXPORT_SYMBOL(json_writer_end_object);
+
+int json_writer_begin_array(struct json_writer *writer)
+{
+	return writer_begin(writer, false);
+}
+EXPORT_SYMBOL(json_writer_begin_array);
+
+int json_writer_end_array(struct json_writer *writer)
+{
+	return writer_end(writer, false);
+}
+EXPORT_SYMBOL(json_writer_end_array);
+
+/* Keys are written in the given order, they are not sorted. */
+int json_writer_key(struct json_writer *writer, const char *key)
+{
+	u32 level;
+	int r;
+
+	if (writer->error < 0)
+		return writer->error;
+
+	if (!writer_in_object(writer) || writer->key)
+		return writer_fail(writer, -EINVAL);
+
+	level = BIT(writer->depth - 1);
+	if (writer->nonempty & level) {
+		r = buffer_add_char(writer->buffer, ',');
+		if (r < 0)
+			return writer_fail(writer, r);
+	}
+	writer->nonempty |= level;
+
+	r = buffer_add_char(writer->buffer, '"');
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	r = json_write_string(writer->buffer, key);
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	r = buffer_add_literal(writer->buffer, "\":");
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	writer->key = true;
+
+	return 0;
+}
+EXPORT_SYMBOL(json_writer_key);
+
+int json_writer_bool(struct json_writer *writer, bool b)
+{
+	int r;
+
+	r = writer_begin_value(writer);
+	if (r < 0)
+		return r;
+
+	if (b)
+		r = buffer_add_literal(writer->buffer, "true");
+	else
+		r = buffer_add_literal(writer->buffer, "false");
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	return 0;
+}
+EXPORT_SYMBOL(json_writer_bool);
+
+int json_writer_int(struct json_writer *writer, long long i)
+{
+	int r;
+
+	r = writer_begin_value(writer);
+	if (r < 0)
+		return r;
+
+	r = buffer_add_int(writer->buffer, i);
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	return 0;
+}
+EXPORT_SYMBOL(json_writer_int);
+
+int json_writer_string(struct json_writer *writer, const char *string)
+{
+	int r;
+
+	r = writer_begin_value(writer);
+	if (r < 0)
+		return r;
+
+	r = buffer_add_char(writer->buffer, '"');
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	r = json_write_string(writer->buffer, string);
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	r = buffer_add_char(writer->buffer, '"');
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	return 0;
+}
+EXPORT_SYMBOL(json_writer_string);
+
+/* Writes an object built as a tree, as the value of a field or element. */
+int json_writer_object(struct json_writer *writer, struct json_object *object)
+{
+	int r;
+
+	r = writer_begin_value(writer);
+	if (r < 0)
+		return r;
+
+	r = json_object_write_to_buffer(object, writer->buffer);
+	if (r < 0)
+		return writer_fail(writer, r);
+
+	return 0;
+}
+EXPORT_SYMBOL(json_writer_object);
@@ -0,0 +1,31 @@
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <linux/json.h>
+#include <linux/types.h>
+
+#include "buffer.h"
+
+/* Nesting levels of containers, one bit each. */
+#define JSON_WRITER_DEPTH_MAX 32
+
+/*
+ * Writes JSON to a buffer as it is produced. The first error sticks, all
+ * further writes return it.
+ */
+struct json_writer {
+	struct buffer *buffer;
+	unsigned int depth;
+
+	/* Per level: the container is an object, it has an element. */
+	u32 objects;
+	u32 nonempty;
+
+	/* A key was written, its value is next. */
+	bool key;
+	int error;
+};
+
+void json_writer_init(struct json_writer *writer, struct buffer *buffer);
+int json_writer_finish(struct json_writer *writer);
+#endif
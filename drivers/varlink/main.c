@@ -1,14 +1,69 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/debugfs.h>
 #include <linux/module.h>
 
+#include "buffer.h"
+#include "connection.h"
+#include "json-array.h"
+#include "json-object.h"
+#include "reply.h"
+#include "reply-cache.h"
+#include "scanner.h"
+
+static struct dentry *varlink_debugfs;
+
 static int __init varlink_init(void)
 {
+	int r;
+
+	r = reply_init();
+	if (r < 0)
+		return r;
+
+	r = connection_init();
+	if (r < 0)
+		goto err_reply;
+
+	r = json_object_init();
+	if (r < 0)
+		goto err_connection;
+
+	r = json_array_init();
+	if (r < 0)
+		goto err_object;
+
+	r = scanner_init();
+	if (r < 0)
+		goto err_array;
+
+	varlink_debugfs = debugfs_create_dir("varlink", NULL);
+	buffer_pool_init(varlink_debugfs);
+	reply_caches_init(varlink_debugfs);
+
 	pr_info("initialized\n");
 	return 0;
+
+err_array:
+	json_array_exit();
+err_object:
+	json_object_exit();
+err_connection:
+	connection_exit();
+err_reply:
+	reply_exit();
+	return r;
 }
 
 static void __exit varlink_exit(void)
 {
+	debugfs_remove_recursive(varlink_debugfs);
+	connection_exit();
+	reply_caches_exit();
+	reply_exit();
+	scanner_exit();
+	json_array_exit();
+	json_object_exit();
+	buffer_pool_exit();
 }
 
 module_init(varlink_init);
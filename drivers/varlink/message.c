@@ -1,56 +1,123 @@
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
+#include "arena.h"
+#include "buffer.h"
+#include "json-object.h"
+#include "json-value.h"
+#include "json-writer.h"
 #include "message.h"
+#include "reply.h"
+#include "scanner.h"
 
-int message_unpack_call(struct json_object *call,
-			char **methodp,
-			struct json_object **parametersp,
+/* Reads "true", "false", or "null" which leaves @bp unchanged. */
+static int message_read_flag(struct scanner *scanner, bool *bp)
+{
+	if (scanner_read_keyword(scanner, "true") >= 0)
+		*bp = true;
+	else if (scanner_read_keyword(scanner, "false") >= 0)
+		*bp = false;
+	else if (scanner_read_keyword(scanner, "null") < 0)
+		return -EBADMSG;
+
+	return 0;
+}
+
+/*
+ * Parses the envelope of a call into @arena. The parameters are only
+ * checked for their syntax, their text is copied to the arena and parsed
+ * by message_parse_parameters() when the method needs them. Missing
+ * parameters return NULL.
+ *
+ * The keys are decoded in place in @data, which is clobbered; the method
+ * is copied, @data does not outlive the call.
+ */
+int message_unpack_call(struct arena *arena,
+			char *data,
+			const char **methodp,
+			char **parametersp,
 			unsigned long long *flagsp)
 {
-	const char *call_method;
-	struct json_object *call_parameters = NULL;
+	struct scanner *scanner;
 	char *method = NULL;
-	struct json_object *parameters = NULL;
+	char *parameters = NULL;
 	bool more = false;
 	bool oneway = false;
+	bool first = true;
 	int r;
 
-	r = json_object_get_string(call, "method", &call_method);
+	r = scanner_new_in_situ(&scanner, arena, data);
 	if (r < 0)
-		return -EBADMSG;
+		return r;
 
-	r = json_object_get_object(call, "parameters", &call_parameters);
-	if (r < 0 && r != -ENOENT)
-		return -EBADMSG;
+	if (scanner_read_operator(scanner, "{") < 0)
+		return -EINVAL;
 
-	r = json_object_get_bool(call, "more", &more);
-	if (r < 0 && r != -ENOENT)
-		return -EBADMSG;
+	while (scanner_peek(scanner) != '}') {
+		char *name;
 
-	r = json_object_get_bool(call, "oneway", &oneway);
-	if (r < 0 && r != -ENOENT)
-		return -EBADMSG;
+		if (!first && scanner_read_operator(scanner, ",") < 0)
+			return -EINVAL;
 
-	method = kstrdup(call_method, GFP_KERNEL);
-	if (!method)
-		return -ENOMEM;
+		r = scanner_read_string(scanner, &name);
+		if (r < 0)
+			return r;
+
+		if (scanner_read_operator(scanner, ":") < 0)
+			return -EINVAL;
+
+		if (strcmp(name, "method") == 0) {
+			if (scanner_peek(scanner) == '"')
+				r = scanner_read_string(scanner, &method);
+			else if (scanner_read_keyword(scanner, "null") < 0)
+				r = -EBADMSG;
+
+		} else if (strcmp(name, "parameters") == 0) {
+			const char *start = scanner_get_position(scanner);
+
+			parameters = NULL;
+			if (*start == '{') {
+				r = json_value_skip(scanner);
+				if (r >= 0) {
+					parameters = arena_strndup(arena, start,
+								   scanner_get_position(scanner) - start);
+					if (!parameters)
+						r = -ENOMEM;
+				}
+			} else if (scanner_read_keyword(scanner, "null") < 0) {
+				r = -EBADMSG;
+			}
+
+		} else if (strcmp(name, "more") == 0) {
+			r = message_read_flag(scanner, &more);
 
-	r = 0;
+		} else if (strcmp(name, "oneway") == 0) {
+			r = message_read_flag(scanner, &oneway);
+
+		} else {
+			r = json_value_skip(scanner);
+		}
 
-	if (call_parameters) {
-		parameters = json_object_ref(call_parameters);
-	} else {
-		r = json_object_new(&parameters);
 		if (r < 0)
-			goto out;
+			return r;
+
+		first = false;
 	}
 
-	*methodp = method;
-	method = NULL;
+	if (scanner_read_operator(scanner, "}") < 0 ||
+	    scanner_peek(scanner) != '\0')
+		return -EINVAL;
+
+	if (!method)
+		return -EBADMSG;
+
+	method = arena_strndup(arena, method, strlen(method));
+	if (!method)
+		return -ENOMEM;
 
+	*methodp = method;
 	*parametersp = parameters;
-	parameters = NULL;
 
 	*flagsp = 0;
 	if (more)
@@ -58,47 +125,161 @@ int message_unpack_call(struct json_object *call,
 	if (oneway)
 		*flagsp |= VARLINK_CALL_ONEWAY;
 
-out:
-	kfree(method);
-	json_object_unref(parameters);
+	return 0;
+}
 
-	return r;
+/*
+ * Builds the parameters from the text kept by message_unpack_call(), their
+ * strings are decoded in place in it. Empty parameters share one read-only
+ * object.
+ */
+int message_parse_parameters(struct arena *arena,
+			     char *parameters,
+			     struct json_object **objectp)
+{
+	const char *p = parameters;
+
+	if (p) {
+		p = skip_spaces(p + 1);
+		if (*p == '}')
+			p = NULL;
+	}
+
+	if (!p) {
+		*objectp = json_object_empty();
+		return 0;
+	}
+
+	return json_object_new_in_arena(objectp, arena, parameters);
 }
 
-int message_pack_reply(const char *error,
-		       struct json_object *parameters,
-		       unsigned long long flags,
-		       struct json_object **replyp)
+/*
+ * Serializes the reply into a message ready to be queued. The envelope is
+ * written directly, with its fields in the order of a serialized object.
+ */
+int message_serialize_reply(const char *error,
+			    struct json_object *parameters,
+			    unsigned long long flags,
+			    struct reply **replyp)
 {
-	struct json_object *reply = NULL;
+	struct reply *reply = NULL;
+	struct buffer *buffer;
+	const char *separator = "";
 	int r;
 
-	r = json_object_new(&reply);
+	r = reply_new(&reply);
 	if (r < 0)
 		return r;
 
+	buffer = reply->buffer;
+
+	r = buffer_add_char(buffer, '{');
+	if (r < 0)
+		goto out;
+
+	if (flags & VARLINK_REPLY_CONTINUES) {
+		r = buffer_add_literal(buffer, "\"continues\":true");
+		if (r < 0)
+			goto out;
+
+		separator = ",";
+	}
+
 	if (error) {
-		r = json_object_set_string(reply, "error", error);
+		r = buffer_printf(buffer, "%s\"error\":\"", separator);
+		if (r < 0)
+			goto out;
+
+		r = json_write_string(buffer, error);
+		if (r < 0)
+			goto out;
+
+		r = buffer_add_char(buffer, '"');
 		if (r < 0)
 			goto out;
+
+		separator = ",";
 	}
 
 	if (parameters) {
-		json_object_set_object(reply, "parameters", parameters);
+		r = buffer_printf(buffer, "%s\"parameters\":", separator);
 		if (r < 0)
 			goto out;
-	}
 
-	if (flags & VARLINK_REPLY_CONTINUES) {
-		json_object_set_bool(reply, "continues", true);
+		r = json_object_write_to_buffer(parameters, buffer);
 		if (r < 0)
 			goto out;
 	}
 
+	r = buffer_add_char(buffer, '}');
+	if (r < 0)
+		goto out;
+
+	r = buffer_add_nul(buffer);
+	if (r < 0)
+		goto out;
+
 	*replyp = reply;
 	reply = NULL;
 
 out:
-	json_object_unref(reply);
+	reply_unref(reply);
 	return r;
 }
+
+/*
+ * Starts a reply whose parameters are streamed with @writer. The envelope
+ * is written around them, with its fields in the order of a serialized
+ * object.
+ */
+int message_begin_reply(unsigned long long flags,
+			struct json_writer *writer,
+			struct reply **replyp)
+{
+	struct reply *reply = NULL;
+	int r;
+
+	r = reply_new(&reply);
+	if (r < 0)
+		return r;
+
+	if (flags & VARLINK_REPLY_CONTINUES)
+		r = buffer_add_literal(reply->buffer,
+				       "{\"continues\":true,\"parameters\":");
+	else
+		r = buffer_add_literal(reply->buffer, "{\"parameters\":");
+	if (r < 0)
+		goto out;
+
+	json_writer_init(writer, reply->buffer);
+	r = json_writer_begin_object(writer);
+	if (r < 0)
+		goto out;
+
+	*replyp = reply;
+	reply = NULL;
+
+out:
+	reply_unref(reply);
+	return r;
+}
+
+/* Closes the parameters and the envelope, the message is ready to be queued. */
+int message_end_reply(struct json_writer *writer, struct reply *reply)
+{
+	int r;
+
+	r = json_writer_end_object(writer);
+	if (r < 0)
+		return r;
+
+	r = json_writer_finish(writer);
+	if (r < 0)
+		return r;
+
+	r = buffer_add_char(reply->buffer, '}');
+	if (r < 0)
+		return r;
+
+	return buffer_add_nul(reply->buffer);
+}
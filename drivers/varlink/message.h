@@ -4,13 +4,27 @@
 #include <linux/json.h>
 #include <linux/varlink.h>
 
-int message_unpack_call(struct json_object *call,
-			char **methodp,
-			struct json_object **parametersp,
+struct arena;
+
+int message_unpack_call(struct arena *arena,
+			char *data,
+			const char **methodp,
+			char **parametersp,
 			unsigned long long *flagsp);
+int message_parse_parameters(struct arena *arena,
+			     char *parameters,
+			     struct json_object **objectp);
+
+struct json_writer;
+struct reply;
+
+int message_serialize_reply(const char *error,
+			    struct json_object *parameters,
+			    unsigned long long flags,
+			    struct reply **replyp);
 
-int message_pack_reply(const char *error,
-		       struct json_object *parameters,
-		       unsigned long long flags,
-		       struct json_object **replyp);
+int message_begin_reply(unsigned long long flags,
+			struct json_writer *writer,
+			struct reply **replyp);
+int message_end_reply(struct json_writer *writer, struct reply *reply);
 #endif
@@ -0,0 +1,287 @@
+#include <linux/debugfs.h>
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "arena.h"
+#include "buffer.h"
+#include "json-object.h"
+#include "reply-cache.h"
+
+struct reply_cache_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	struct reply *reply;
+
+	/* Set by lookups, the clock hand spares the entry once. */
+	struct list_head clock_node;
+	bool referenced;
+
+	struct interface_member *member;
+	u32 hash;
+	unsigned int size;
+	char data[];
+};
+
+static struct dentry *reply_caches_debugfs;
+
+static void reply_cache_entry_free(struct rcu_head *rcu)
+{
+	struct reply_cache_entry *entry;
+
+	entry = container_of(rcu, struct reply_cache_entry, rcu);
+	reply_unref(entry->reply);
+	kfree(entry);
+}
+
+/* Called with the lock held. */
+static void reply_cache_entry_del(struct reply_cache *cache,
+				  struct reply_cache_entry *entry)
+{
+	hash_del_rcu(&entry->node);
+	list_del(&entry->clock_node);
+	cache->n_entries--;
+	call_rcu(&entry->rcu, reply_cache_entry_free);
+}
+
+/*
+ * Drops the first entry which was not looked up since the clock hand
+ * passed it, or after a full turn the one under the hand. Called with the
+ * lock held.
+ */
+static void reply_cache_evict(struct reply_cache *cache)
+{
+	struct reply_cache_entry *entry;
+	unsigned int n;
+
+	for (n = cache->n_entries; n > 0; n--) {
+		entry = list_first_entry(&cache->clock,
+					 struct reply_cache_entry, clock_node);
+		if (!READ_ONCE(entry->referenced))
+			break;
+
+		WRITE_ONCE(entry->referenced, false);
+		list_move_tail(&entry->clock_node, &cache->clock);
+	}
+
+	entry = list_first_entry(&cache->clock, struct reply_cache_entry,
+				 clock_node);
+	reply_cache_entry_del(cache, entry);
+}
+
+static bool reply_cache_entry_match(struct reply_cache_entry *entry,
+				    struct reply_cache_key *key)
+{
+	return entry->hash == key->hash &&
+	       entry->member == key->member &&
+	       entry->size == key->size &&
+	       memcmp(entry->data, key->data, key->size) == 0;
+}
+
+static int reply_cache_show(struct seq_file *m, void *unused)
+{
+	struct reply_cache *cache = m->private;
+
+	seq_printf(m, "hits: %lu\n", atomic_long_read(&cache->hits));
+	seq_printf(m, "misses: %lu\n", atomic_long_read(&cache->misses));
+	seq_printf(m, "entries: %u\n", READ_ONCE(cache->n_entries));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(reply_cache);
+
+void reply_cache_init(struct reply_cache *cache, const char *name)
+{
+	spin_lock_init(&cache->lock);
+	hash_init(cache->entries);
+	cache->n_entries = 0;
+	INIT_LIST_HEAD(&cache->clock);
+	cache->generation = 0;
+	atomic_long_set(&cache->hits, 0);
+	atomic_long_set(&cache->misses, 0);
+	cache->debugfs = debugfs_create_file(name, 0444, reply_caches_debugfs,
+					     cache, &reply_cache_fops);
+}
+
+void reply_cache_clear(struct reply_cache *cache)
+{
+	debugfs_remove(cache->debugfs);
+	cache->debugfs = NULL;
+
+	reply_cache_invalidate(cache, NULL, NULL);
+}
+
+/*
+ * The parameters serialize with their fields sorted by name, which makes
+ * the serialization canonical; empty parameters are not serialized. The
+ * key is allocated in @arena, or with kmalloc() without one. Returns
+ * -E2BIG for parameters which are not cached.
+ */
+int reply_cache_key_new(struct reply_cache *cache,
+			struct arena *arena,
+			struct interface_member *member,
+			struct json_object *parameters,
+			struct reply_cache_key **keyp)
+{
+	struct buffer *buffer = NULL;
+	struct reply_cache_key *key;
+	unsigned int size = 0;
+	int r;
+
+	if (json_object_get_field_names(parameters, NULL) > 0) {
+		r = buffer_pool_get(&buffer);
+		if (r < 0)
+			return r;
+
+		r = json_object_write_to_buffer(parameters, buffer);
+		if (r < 0)
+			goto out;
+
+		size = buffer_size(buffer);
+		if (size > REPLY_CACHE_KEY_MAX) {
+			r = -E2BIG;
+			goto out;
+		}
+	}
+
+	if (arena)
+		key = arena_alloc(arena, struct_size(key, data, size));
+	else
+		key = kmalloc(struct_size(key, data, size), GFP_KERNEL);
+	if (!key) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	key->member = member;
+	key->size = size;
+	if (buffer)
+		buffer_copy(buffer, 0, key->data, size);
+	key->hash = jhash(key->data, size, (unsigned long)member);
+	key->generation = READ_ONCE(cache->generation);
+
+	*keyp = key;
+	r = 0;
+
+out:
+	buffer_pool_put(buffer);
+	return r;
+}
+
+/* Returns a reference to the cached reply, or NULL. */
+struct reply *reply_cache_lookup(struct reply_cache *cache,
+				 struct reply_cache_key *key)
+{
+	struct reply_cache_entry *entry;
+	struct reply *reply = NULL;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(cache->entries, entry, node, key->hash) {
+		if (reply_cache_entry_match(entry, key)) {
+			if (!READ_ONCE(entry->referenced))
+				WRITE_ONCE(entry->referenced, true);
+			reply = reply_ref(entry->reply);
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	if (reply)
+		atomic_long_inc(&cache->hits);
+	else
+		atomic_long_inc(&cache->misses);
+
+	return reply;
+}
+
+/*
+ * Stores the reply of a miss, unless the cache was invalidated since. A
+ * full cache evicts an entry for it.
+ */
+void reply_cache_store(struct reply_cache *cache,
+		       struct reply_cache_key *key,
+		       struct reply *reply)
+{
+	struct reply_cache_entry *entry, *e;
+
+	/* Do not allocate for a reply which is not stored. */
+	if (key->generation != READ_ONCE(cache->generation))
+		return;
+
+	entry = kmalloc(struct_size(entry, data, key->size), GFP_KERNEL);
+	if (!entry)
+		return;
+
+	entry->reply = reply_ref(reply);
+	entry->referenced = false;
+	entry->member = key->member;
+	entry->hash = key->hash;
+	entry->size = key->size;
+	memcpy(entry->data, key->data, key->size);
+
+	spin_lock(&cache->lock);
+	if (key->generation != cache->generation)
+		goto out;
+
+	hash_for_each_possible(cache->entries, e, node, key->hash)
+		if (reply_cache_entry_match(e, key))
+			goto out;
+
+	if (cache->n_entries >= REPLY_CACHE_MAX)
+		reply_cache_evict(cache);
+
+	hash_add_rcu(cache->entries, &entry->node, entry->hash);
+	list_add_tail(&entry->clock_node, &cache->clock);
+	cache->n_entries++;
+	entry = NULL;
+
+out:
+	spin_unlock(&cache->lock);
+
+	if (entry) {
+		reply_unref(entry->reply);
+		kfree(entry);
+	}
+}
+
+/*
+ * Drops the cached reply of @key, all replies of @member if @key is NULL,
+ * or all replies if @member is NULL.
+ */
+void reply_cache_invalidate(struct reply_cache *cache,
+			    struct interface_member *member,
+			    struct reply_cache_key *key)
+{
+	struct reply_cache_entry *entry;
+	struct hlist_node *tmp;
+	unsigned int bucket;
+
+	spin_lock(&cache->lock);
+	cache->generation++;
+
+	hash_for_each_safe(cache->entries, bucket, tmp, entry, node) {
+		if (member && entry->member != member)
+			continue;
+
+		if (key && !reply_cache_entry_match(entry, key))
+			continue;
+
+		reply_cache_entry_del(cache, entry);
+	}
+	spin_unlock(&cache->lock);
+}
+
+void reply_caches_init(struct dentry *debugfs)
+{
+	reply_caches_debugfs = debugfs_create_dir("reply_cache", debugfs);
+}
+
+/* Wait for the entries, their replies come from the reply cache. */
+void reply_caches_exit(void)
+{
+	rcu_barrier();
+}
@@ -0,0 +1,73 @@
+#ifndef _REPLY_CACHE_H_
+#define _REPLY_CACHE_H_
+
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/json.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "interface.h"
+#include "reply.h"
+
+struct arena;
+struct dentry;
+
+#define REPLY_CACHE_BITS 6
+
+/* The number of cached replies, further replies evict older ones. */
+#define REPLY_CACHE_MAX 256
+
+/* Calls with larger serialized parameters are not cached. */
+#define REPLY_CACHE_KEY_MAX 256
+
+/*
+ * Serialized replies of methods with VARLINK_METHOD_CACHE, keyed by the
+ * method and its canonically serialized parameters. Lookups take no lock,
+ * changes take the spinlock.
+ */
+struct reply_cache {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(entries, REPLY_CACHE_BITS);
+	unsigned int n_entries;
+
+	/* The entries in the order the clock hand visits them for eviction. */
+	struct list_head clock;
+
+	/* Replies computed before an invalidation are not stored. */
+	unsigned long generation;
+
+	atomic_long_t hits;
+	atomic_long_t misses;
+	struct dentry *debugfs;
+};
+
+struct reply_cache_key {
+	struct interface_member *member;
+	u32 hash;
+	unsigned long generation;
+	unsigned int size;
+	char data[];
+};
+
+void reply_cache_init(struct reply_cache *cache, const char *name);
+void reply_cache_clear(struct reply_cache *cache);
+
+int reply_cache_key_new(struct reply_cache *cache,
+			struct arena *arena,
+			struct interface_member *member,
+			struct json_object *parameters,
+			struct reply_cache_key **keyp);
+struct reply *reply_cache_lookup(struct reply_cache *cache,
+				 struct reply_cache_key *key);
+void reply_cache_store(struct reply_cache *cache,
+		       struct reply_cache_key *key,
+		       struct reply *reply);
+void reply_cache_invalidate(struct reply_cache *cache,
+			    struct interface_member *member,
+			    struct reply_cache_key *key);
+
+void reply_caches_init(struct dentry *debugfs);
+void reply_caches_exit(void);
+#endif
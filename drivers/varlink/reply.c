@@ -0,0 +1,334 @@
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/varlink.h>
+#include <linux/vmalloc.h>
+
+#include "buffer.h"
+#include "reply.h"
+
+static struct kmem_cache *reply_cache;
+static struct kmem_cache *reply_entry_cache;
+
+int reply_new(struct reply **replyp)
+{
+	struct reply *reply;
+	int r;
+
+	reply = kmem_cache_zalloc(reply_cache, GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
+
+	r = buffer_pool_get(&reply->buffer);
+	if (r < 0) {
+		kmem_cache_free(reply_cache, reply);
+		return r;
+	}
+
+	refcount_set(&reply->refcount, 1);
+	reply->entry.reply = reply;
+
+	*replyp = reply;
+	return 0;
+}
+
+struct reply *reply_ref(struct reply *reply)
+{
+	refcount_inc(&reply->refcount);
+	return reply;
+}
+
+struct reply *reply_unref(struct reply *reply)
+{
+	if (!reply)
+		return NULL;
+
+	if (!refcount_dec_and_test(&reply->refcount))
+		return NULL;
+
+	buffer_pool_put(reply->buffer);
+	kmem_cache_free(reply_cache, reply);
+
+	return NULL;
+}
+
+static void reply_entry_free(struct reply_entry *entry)
+{
+	struct reply *reply = entry->reply;
+
+	if (entry->release)
+		entry->release(entry);
+	else if (entry != &reply->entry)
+		kmem_cache_free(reply_entry_cache, entry);
+
+	reply_unref(reply);
+}
+
+void reply_queue_init(struct reply_queue *queue)
+{
+	init_llist_head(&queue->incoming);
+	atomic_set(&queue->n_replies, 0);
+	atomic_set(&queue->size, 0);
+	INIT_LIST_HEAD(&queue->replies);
+	queue->offset = 0;
+}
+
+/* Moves the pushed replies behind the collected ones, in push order. */
+static void reply_queue_collect(struct reply_queue *queue)
+{
+	struct llist_node *first;
+	struct reply_entry *entry, *tmp;
+
+	first = llist_del_all(&queue->incoming);
+	if (!first)
+		return;
+
+	first = llist_reverse_order(first);
+	llist_for_each_entry_safe(entry, tmp, first, llnode)
+		list_add_tail(&entry->node, &queue->replies);
+}
+
+void reply_queue_clear(struct reply_queue *queue)
+{
+	struct reply_entry *entry, *tmp;
+
+	reply_queue_collect(queue);
+	list_for_each_entry_safe(entry, tmp, &queue->replies, node)
+		reply_entry_free(entry);
+
+	reply_queue_init(queue);
+}
+
+/*
+ * Queues a reference without taking a lock. The counters are raised before
+ * the reply is visible to the reader, who lowers them after consuming it,
+ * so that they never drop below zero. The reply is linked with @entry if the caller
+ * provides one, otherwise with its own entry or an allocated one.
+ */
+int reply_queue_push(struct reply_queue *queue, struct reply *reply,
+		     struct reply_entry *entry)
+{
+	if (entry) {
+		entry->reply = reply;
+	} else if (!xchg(&reply->queued, 1)) {
+		entry = &reply->entry;
+	} else {
+		entry = kmem_cache_alloc(reply_entry_cache, GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+
+		entry->reply = reply;
+		entry->release = NULL;
+	}
+
+	reply_ref(reply);
+	atomic_add(buffer_size(reply->buffer), &queue->size);
+	atomic_inc(&queue->n_replies);
+	llist_add(&entry->llnode, &queue->incoming);
+
+	return 0;
+}
+
+/*
+ * Copies as many whole messages as fit into @iter. Only if not even the
+ * first message fits, it is returned in pieces and the remainder stays at
+ * the head of the queue. Returns -EAGAIN if a pushed reply is not visible
+ * yet. Called by one reader at a time.
+ */
+ssize_t reply_queue_read(struct reply_queue *queue, struct iov_iter *iter)
+{
+	size_t count = iov_iter_count(iter);
+	ssize_t n_read = 0;
+
+	reply_queue_collect(queue);
+	if (list_empty(&queue->replies))
+		return -EAGAIN;
+
+	while (!list_empty(&queue->replies)) {
+		struct reply_entry *entry;
+		struct reply *reply;
+		unsigned int n;
+		int r;
+
+		entry = list_first_entry(&queue->replies, struct reply_entry,
+					 node);
+		reply = entry->reply;
+		n = buffer_size(reply->buffer) - queue->offset;
+
+		if (n > count) {
+			if (n_read > 0)
+				break;
+
+			n = count;
+		}
+
+		r = buffer_copy_to_iter(reply->buffer, queue->offset, iter, n);
+		if (r < 0)
+			return n_read > 0 ? n_read : r;
+
+		n_read += n;
+		count -= n;
+		atomic_sub(n, &queue->size);
+
+		if (queue->offset + n < buffer_size(reply->buffer)) {
+			queue->offset += n;
+			break;
+		}
+
+		list_del(&entry->node);
+		atomic_dec(&queue->n_replies);
+		queue->offset = 0;
+		reply_entry_free(entry);
+	}
+
+	return n_read;
+}
+
+int reply_ring_new(struct reply_ring **ringp)
+{
+	struct reply_ring *ring;
+
+	BUILD_BUG_ON(!is_power_of_2(VARLINK_RING_SIZE));
+
+	ring = kzalloc(sizeof(struct reply_ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->header = vmalloc_user(PAGE_SIZE + VARLINK_RING_SIZE);
+	if (!ring->header) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->data = (char *)ring->header + PAGE_SIZE;
+	ring->size = VARLINK_RING_SIZE;
+	ring->header->size = VARLINK_RING_SIZE;
+	ring->header->offset = PAGE_SIZE;
+
+	*ringp = ring;
+	return 0;
+}
+
+struct reply_ring *reply_ring_free(struct reply_ring *ring)
+{
+	if (!ring)
+		return NULL;
+
+	vfree(ring->header);
+	kfree(ring);
+
+	return NULL;
+}
+
+int reply_ring_mmap(struct reply_ring *ring, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->header, 0);
+}
+
+/* Userspace owns the tail, never trust it beyond the size of the ring. */
+unsigned int reply_ring_used(struct reply_ring *ring)
+{
+	u32 tail = smp_load_acquire(&ring->header->tail);
+
+	return min(ring->head - tail, ring->size);
+}
+
+static unsigned int count_nul(const char *p, unsigned int size)
+{
+	const char *end = p + size;
+	unsigned int n = 0;
+
+	while ((p = memchr(p, '\0', end - p))) {
+		n++;
+		p++;
+	}
+
+	return n;
+}
+
+/* Messages not yet consumed, every message ends with a NUL byte. */
+unsigned int reply_ring_count(struct reply_ring *ring)
+{
+	unsigned int used = reply_ring_used(ring);
+	unsigned int offset = (ring->head - used) & (ring->size - 1);
+	unsigned int n = min(used, ring->size - offset);
+
+	return count_nul(ring->data + offset, n) +
+	       count_nul(ring->data, used - n);
+}
+
+/* Appends the message, or returns -ENOSPC if it does not fit as a whole. */
+int reply_ring_push(struct reply_ring *ring, struct buffer *buffer)
+{
+	unsigned int size = buffer_size(buffer);
+	unsigned int offset = ring->head & (ring->size - 1);
+	unsigned int n;
+
+	if (size > ring->size - reply_ring_used(ring))
+		return -ENOSPC;
+
+	n = min(size, ring->size - offset);
+	buffer_copy(buffer, 0, ring->data + offset, n);
+	buffer_copy(buffer, n, ring->data, size - n);
+
+	ring->head += size;
+	smp_store_release(&ring->header->head, ring->head);
+
+	return 0;
+}
+
+/* Consumes data from the ring like reply_queue_read(). */
+ssize_t reply_ring_read(struct reply_ring *ring, struct iov_iter *iter)
+{
+	u32 tail = ring->head - reply_ring_used(ring);
+	unsigned int mask = ring->size - 1;
+	unsigned int size;
+	unsigned int n;
+
+	size = min_t(size_t, ring->head - tail, iov_iter_count(iter));
+
+	/* End with the last message which fits. */
+	if (size < ring->head - tail) {
+		for (n = size; n > 0; n--)
+			if (ring->data[(tail + n - 1) & mask] == '\0')
+				break;
+
+		if (n > 0)
+			size = n;
+	}
+
+	n = min(size, ring->size - (tail & mask));
+	if (copy_to_iter(ring->data + (tail & mask), n, iter) != n ||
+	    copy_to_iter(ring->data, size - n, iter) != size - n)
+		return -EFAULT;
+
+	smp_store_release(&ring->header->tail, tail + size);
+
+	return size;
+}
+
+int reply_init(void)
+{
+	reply_cache = KMEM_CACHE(reply, 0);
+	if (!reply_cache)
+		return -ENOMEM;
+
+	reply_entry_cache = KMEM_CACHE(reply_entry, 0);
+	if (!reply_entry_cache) {
+		kmem_cache_destroy(reply_cache);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void reply_exit(void)
+{
+	kmem_cache_destroy(reply_entry_cache);
+	kmem_cache_destroy(reply_cache);
+}
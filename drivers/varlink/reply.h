@@ -0,0 +1,121 @@
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <linux/compiler.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/refcount.h>
+#include <linux/types.h>
+
+#include "buffer.h"
+
+struct iov_iter;
+struct varlink_ring;
+struct vm_area_struct;
+
+struct reply;
+
+/*
+ * A reference to a reply in a queue. Entries which are neither embedded
+ * in their reply nor allocated are handed back with @release.
+ */
+struct reply_entry {
+	union {
+		struct llist_node llnode;
+		struct list_head node;
+	};
+	struct reply *reply;
+	void (*release)(struct reply_entry *entry);
+};
+
+/* Hands back an entry of the caller's which was not queued. */
+static inline void reply_entry_put(struct reply_entry *entry)
+{
+	if (entry)
+		entry->release(entry);
+}
+
+/*
+ * A serialized message, including its terminating NUL. It is immutable once
+ * it is queued, and it can be queued to any number of connections.
+ */
+struct reply {
+	refcount_t refcount;
+	struct buffer *buffer;
+
+	/*
+	 * Entry for the first queue, further queues allocate one. Claimed
+	 * with xchg(), cached replies are pushed by many producers.
+	 */
+	struct reply_entry entry;
+	unsigned long queued;
+};
+
+int reply_new(struct reply **replyp);
+struct reply *reply_ref(struct reply *reply);
+struct reply *reply_unref(struct reply *reply);
+
+/*
+ * Messages waiting to be read. Any number of producers push without a
+ * lock, the reader collects them in order; readers provide their own
+ * locking.
+ */
+struct reply_queue {
+	struct llist_head incoming;
+	atomic_t n_replies;
+
+	/* Bytes not yet read. */
+	atomic_t size;
+
+	/* Collected replies, and bytes already read from the first one. */
+	struct list_head replies;
+	unsigned int offset;
+};
+
+/*
+ * The counters are raised before a reply is linked, they include replies
+ * which are being pushed. Whether there is a reply to read is told by
+ * reply_queue_empty().
+ */
+static inline unsigned int reply_queue_length(struct reply_queue *queue)
+{
+	return atomic_read(&queue->n_replies);
+}
+
+static inline unsigned int reply_queue_size(struct reply_queue *queue)
+{
+	return atomic_read(&queue->size);
+}
+
+static inline bool reply_queue_empty(struct reply_queue *queue)
+{
+	return llist_empty(&queue->incoming) && list_empty(&queue->replies);
+}
+
+void reply_queue_init(struct reply_queue *queue);
+void reply_queue_clear(struct reply_queue *queue);
+int reply_queue_push(struct reply_queue *queue, struct reply *reply,
+		     struct reply_entry *entry);
+ssize_t reply_queue_read(struct reply_queue *queue, struct iov_iter *iter);
+
+/* Replies in memory shared with userspace, see struct varlink_ring. */
+struct reply_ring {
+	struct varlink_ring *header;
+	char *data;
+	unsigned int size;
+
+	/* Our copy of the head, the shared one is writable by userspace. */
+	u32 head;
+};
+
+int reply_ring_new(struct reply_ring **ringp);
+struct reply_ring *reply_ring_free(struct reply_ring *ring);
+int reply_ring_mmap(struct reply_ring *ring, struct vm_area_struct *vma);
+unsigned int reply_ring_used(struct reply_ring *ring);
+unsigned int reply_ring_count(struct reply_ring *ring);
+int reply_ring_push(struct reply_ring *ring, struct buffer *buffer);
+ssize_t reply_ring_read(struct reply_ring *ring, struct iov_iter *iter);
+
+int reply_init(void);
+void reply_exit(void);
+#endif
@@ -1,6 +1,7 @@
 #include <linux/json.h>
 #include <linux/slab.h>
 
+#include "arena.h"
 #include "buffer.h"
 #include "scanner.h"
 
@@ -8,32 +9,67 @@ struct scanner {
 	const char *string;
 	const char *p;
 	bool comment;
+
+	/* Strings are decoded into the input, which the caller handed over. */
+	bool in_situ;
+
+	/* Holds the scanner and the strings it reads, if not NULL. */
+	struct arena *arena;
 };
 
+static struct kmem_cache *scanner_cache;
+
 int scanner_new(struct scanner **scannerp,
+		struct arena *arena,
 		const char *string,
 		bool accept_comment)
 {
 	struct scanner *scanner;
 
-	scanner = kzalloc(sizeof(struct scanner), GFP_KERNEL);
+	if (arena)
+		scanner = arena_alloc(arena, sizeof(struct scanner));
+	else
+		scanner = kmem_cache_zalloc(scanner_cache, GFP_KERNEL);
 	if (!scanner)
 		return -ENOMEM;
 
 	scanner->string = string;
 	scanner->p = scanner->string;
 	scanner->comment = accept_comment;
+	scanner->arena = arena;
 
 	*scannerp = scanner;
 	return 0;
 }
 
+int scanner_new_in_situ(struct scanner **scannerp,
+			struct arena *arena,
+			char *string)
+{
+	int r;
+
+	r = scanner_new(scannerp, arena, string, false);
+	if (r < 0)
+		return r;
+
+	(*scannerp)->in_situ = true;
+
+	return 0;
+}
+
 struct scanner *scanner_free(struct scanner *scanner)
 {
-	kfree(scanner);
+	if (scanner && !scanner->arena)
+		kmem_cache_free(scanner_cache, scanner);
+
 	return NULL;
 }
 
+struct arena *scanner_get_arena(struct scanner *scanner)
+{
+	return scanner->arena;
+}
+
 static const char *scanner_advance(struct scanner *scanner)
 {
 	for (;;) {
@@ -64,6 +100,12 @@ char scanner_peek(struct scanner *scanner)
 	return *scanner->p;
 }
 
+/* The start of the next token. */
+const char *scanner_get_position(struct scanner *scanner)
+{
+	return scanner_advance(scanner);
+}
+
 static int unhex(char d, unsigned char *valuep)
 {
 	switch (d) {
@@ -84,7 +126,8 @@ static int unhex(char d, unsigned char *valuep)
 	}
 }
 
-static int read_unicode_char(const char *p, struct buffer *buffer)
+/* Decodes the four digits of \uXXXX, returns the number of UTF-8 bytes. */
+static int decode_unicode_char(const char *p, char *utf8)
 {
 	unsigned int i;
 	unsigned char digits[4];
@@ -103,37 +146,69 @@ static int read_unicode_char(const char *p, struct buffer *buffer)
 	cp = digits[0] << 12 | digits[1] << 8 | digits[2] << 4 | digits[3];
 
 	if (cp <= 0x007f) {
-		r = buffer_printf(buffer, "%c", (char)cp);
-		if (r < 0)
-			return r;
-
-	} else if (cp <= 0x07ff) {
-		r = buffer_printf(buffer, "%c", (char)(0xc0 | (cp >> 6)));
-		if (r < 0)
-			return r;
+		utf8[0] = (char)cp;
+		return 1;
+	}
 
-		r = buffer_printf(buffer, "%c", (char)(0x80 | (cp & 0x3f)));
-		if (r < 0)
-			return r;
+	if (cp <= 0x07ff) {
+		utf8[0] = (char)(0xc0 | (cp >> 6));
+		utf8[1] = (char)(0x80 | (cp & 0x3f));
+		return 2;
 	}
 
-	else {
-		r = buffer_printf(buffer, "%c", (char)(0xe0 | (cp >> 12)));
-		if (r < 0)
-			return r;
+	utf8[0] = (char)(0xe0 | (cp >> 12));
+	utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+	utf8[2] = (char)(0x80 | (cp & 0x3f));
+	return 3;
+}
 
-		r = buffer_printf(buffer, "%c", (char)(0x80 | ((cp >> 6) & 0x3f)));
-		if (r < 0)
-			return r;
+static int read_unicode_char(const char *p, struct buffer *buffer)
+{
+	char *utf8;
+	int r;
 
-		r = buffer_printf(buffer, "%c", (char)(0x80 | (cp & 0x3f)));
-		if (r < 0)
-			return r;
-	}
+	r = buffer_reserve(buffer, 3, &utf8);
+	if (r < 0)
+		return r;
+
+	r = decode_unicode_char(p, utf8);
+	if (r < 0)
+		return r;
+
+	buffer_commit(buffer, r);
 
 	return 0;
 }
 
+/* The character of a single-character escape, or -EINVAL. */
+static int unescape_char(char c)
+{
+	switch (c) {
+	case '"':
+	case '\\':
+	case '/':
+		return c;
+
+	case 'b':
+		return '\b';
+
+	case 'f':
+		return '\f';
+
+	case 'n':
+		return '\n';
+
+	case 'r':
+		return '\r';
+
+	case 't':
+		return '\t';
+
+	default:
+		return -EINVAL;
+	}
+}
+
 static unsigned int scanner_word_len(struct scanner *scanner)
 {
 	unsigned int i;
@@ -198,115 +273,236 @@ int scanner_read_number(struct scanner *scanner, long long *numberp)
 	return 0;
 }
 
-int scanner_read_string(struct scanner *scanner, char **stringp)
+/* Decodes the string at the scanner's position, including its NUL. */
+static int scanner_read_string_to_buffer(struct scanner *scanner,
+					 struct buffer *buffer)
 {
-	struct buffer *buffer = NULL;
-	const char *p;
+	const char *p = scanner->p + 1;
+	const char *run;
 	int r;
 
-	p = scanner_advance(scanner);
-	if (*p != '"')
-		return -EINVAL;
+	for (run = p;; p++) {
+		char c;
 
-	p++;
+		if (*p == '\0')
+			return -EINVAL;
 
-	r = buffer_new(&buffer, 8);
-	if (r < 0)
-		return r;
+		if (*p != '"' && *p != '\\')
+			continue;
 
-	for (;;) {
-		if (*p == '\0') {
-			r = EINVAL;
-			goto out;
-		}
+		/* Copy the run of characters which are not escaped. */
+		r = buffer_add(buffer, run, p - run);
+		if (r < 0)
+			return r;
 
 		if (*p == '"') {
 			p++;
 			break;
 		}
 
-		if (*p == '\\') {
-			p++;
+		p++;
 
-			switch (*p) {
-			case '"':
-				r = buffer_printf(buffer, "\"");
-				if (r < 0)
-					goto out;
-				break;
+		if (*p == 'u') {
+			r = read_unicode_char(p + 1, buffer);
+			if (r < 0)
+				return r;
 
-			case '\\':
-				r = buffer_printf(buffer, "\\");
-				if (r < 0)
-					goto out;
-				break;
+			p += 4;
+			run = p + 1;
+			continue;
+		}
 
-			case '/':
-				r = buffer_printf(buffer, "/");
-				if (r < 0)
-					goto out;
-				break;
+		c = unescape_char(*p);
+		if (c < 0)
+			return c;
 
-			case 'b':
-				r = buffer_printf(buffer, "\b");
-				if (r < 0)
-					goto out;
-				break;
+		r = buffer_add_char(buffer, c);
+		if (r < 0)
+			return r;
 
-			case 'f':
-				r = buffer_printf(buffer, "\f");
-				if (r < 0)
-					goto out;
-				break;
+		run = p + 1;
+	}
 
-			case 'n':
-				r = buffer_printf(buffer, "\n");
-				if (r < 0)
-					goto out;
-				break;
+	r = buffer_add_nul(buffer);
+	if (r < 0)
+		return r;
 
-			case 'r':
-				r = buffer_printf(buffer, "\r");
-				if (r < 0)
-					goto out;
-				break;
+	scanner->p = p;
 
-			case 't':
-				r = buffer_printf(buffer, "\t");
-				if (r < 0)
-					goto out;
-				break;
+	return 0;
+}
 
-			case 'u':
-				r = read_unicode_char(p + 1, buffer);
-				if (r < 0)
-					goto out;
+/*
+ * Decodes a string in place; escapes never take more room than what they
+ * decode to, so the string and its terminating NUL fit where it was read
+ * from. The input is owned by the scanner's user, it is only ever written
+ * to in this mode.
+ */
+static int scanner_read_string_in_situ(struct scanner *scanner, char **stringp)
+{
+	char *string = (char *)scanner->p + 1;
+	char *p = string + strcspn(string, "\"\\");
+	char *w = p;
+	int c;
+	int r;
 
-				p += 4;
-				break;
+	while (*p != '"') {
+		if (*p == '\0')
+			return -EINVAL;
 
-			default:
-				r = -EINVAL;
-				goto out;
-			}
+		if (*p != '\\') {
+			*w++ = *p++;
+			continue;
+		}
+
+		p++;
 
-		} else {
-			r = buffer_printf(buffer, "%c", *p);
+		if (*p == 'u') {
+			r = decode_unicode_char(p + 1, w);
 			if (r < 0)
-				goto out;
+				return r;
+
+			w += r;
+			p += 5;
+			continue;
 		}
 
+		c = unescape_char(*p);
+		if (c < 0)
+			return c;
+
+		*w++ = (char)c;
 		p++;
 	}
 
+	*w = '\0';
+	scanner->p = p + 1;
+	*stringp = string;
+
+	return 0;
+}
+
+/*
+ * Reads a string into the scanner's arena. A string without escapes is
+ * copied as it is, others are decoded in a pooled buffer first.
+ */
+static int scanner_read_string_arena(struct scanner *scanner, char **stringp)
+{
+	struct buffer *buffer = NULL;
+	const char *p = scanner->p + 1;
+	char *string;
+	int size;
+	int r;
+
+	p += strcspn(p, "\"\\");
+	if (*p == '"') {
+		string = arena_strndup(scanner->arena, scanner->p + 1,
+				       p - scanner->p - 1);
+		if (!string)
+			return -ENOMEM;
+
+		scanner->p = p + 1;
+		*stringp = string;
+		return 0;
+	}
+
+	r = buffer_pool_get(&buffer);
+	if (r < 0)
+		return r;
+
+	r = scanner_read_string_to_buffer(scanner, buffer);
+	if (r < 0)
+		goto out;
+
+	size = buffer_size(buffer);
+	string = arena_alloc(scanner->arena, size);
+	if (!string) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	buffer_copy(buffer, 0, string, size);
+	*stringp = string;
+
+out:
+	buffer_pool_put(buffer);
+	return r;
+}
+
+int scanner_read_string(struct scanner *scanner, char **stringp)
+{
+	struct buffer *buffer = NULL;
+	int r;
+
+	if (scanner_advance(scanner)[0] != '"')
+		return -EINVAL;
+
+	if (scanner->in_situ)
+		return scanner_read_string_in_situ(scanner, stringp);
+
+	if (scanner->arena)
+		return scanner_read_string_arena(scanner, stringp);
+
+	r = buffer_new(&buffer, 8);
+	if (r < 0)
+		return r;
+
+	r = scanner_read_string_to_buffer(scanner, buffer);
+	if (r < 0)
+		goto out;
+
 	buffer_steal_data(buffer, stringp);
-	scanner->p = p;
 
 out:
 	buffer_free(buffer);
 	return r;
 }
 
+/* Checks the escapes of a string and steps over it, without decoding it. */
+int scanner_skip_string(struct scanner *scanner)
+{
+	const char *p = scanner_advance(scanner);
+	unsigned char digit;
+	unsigned int i;
+
+	if (*p != '"')
+		return -EINVAL;
+
+	for (p++; *p != '"'; p++) {
+		if (*p == '\0')
+			return -EINVAL;
+
+		if (*p != '\\')
+			continue;
+
+		p++;
+		switch (*p) {
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			break;
+
+		case 'u':
+			for (i = 0; i < 4; i++)
+				if (unhex(*++p, &digit) < 0)
+					return -EINVAL;
+			break;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	scanner->p = p + 1;
+
+	return 0;
+}
+
 int scanner_read_word(struct scanner *scanner, char **namep)
 {
 	unsigned int len = scanner_word_len(scanner);
@@ -352,3 +548,17 @@ int scanner_read_operator(struct scanner *scanner, const char *op)
 	scanner->p += length;
 	return 0;
 }
+
+int scanner_init(void)
+{
+	scanner_cache = KMEM_CACHE(scanner, 0);
+	if (!scanner_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void scanner_exit(void)
+{
+	kmem_cache_destroy(scanner_cache);
+}
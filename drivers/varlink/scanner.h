@@ -1,11 +1,22 @@
 #ifndef _SCANNER_H_
 #define _SCANNER_H_
 
+struct arena;
 struct scanner;
 
-int scanner_new(struct scanner **scannerp, const char *string,
-		bool accept_comment);
+/* With an @arena, the scanner and the strings it reads are allocated in it. */
+int scanner_new(struct scanner **scannerp, struct arena *arena,
+		const char *string, bool accept_comment);
+
+/*
+ * Parses @string in place: strings are unescaped and NUL-terminated inside
+ * it and point into it. @string must stay around as long as the @arena.
+ */
+int scanner_new_in_situ(struct scanner **scannerp, struct arena *arena,
+			char *string);
 struct scanner *scanner_free(struct scanner *scanner);
+struct arena *scanner_get_arena(struct scanner *scanner);
+const char *scanner_get_position(struct scanner *scanner);
 
 /* Advances the scanner and returns the first character of the next token. */
 char scanner_peek(struct scanner *scanner);
@@ -13,7 +24,11 @@ char scanner_peek(struct scanner *scanner);
 int scanner_read_keyword(struct scanner *scanner, const char *keyword);
 int scanner_read_number(struct scanner *scanner, long long *numberp);
 int scanner_read_string(struct scanner *scanner, char **stringp);
+int scanner_skip_string(struct scanner *scanner);
 int scanner_read_operator(struct scanner *scanner, const char *op);
 int scanner_read_operator_skip(struct scanner *scanner, const char *op);
 int scanner_read_word(struct scanner *scanner, char **namep);
+
+int scanner_init(void);
+void scanner_exit(void);
 #endif
@@ -1,42 +1,61 @@
-#include <linux/idr.h>
+#include <linux/compat.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/poll.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/varlink.h>
+#include <linux/version.h>
+#include <asm/ioctls.h>
 
 #include "connection.h"
 #include "message.h"
 #include "service-io.h"
 
-static DEFINE_IDR(service_io_idr);
-static DEFINE_MUTEX(service_io_lock);
-
+/* Completion of commands through task work needs io_uring/cmd.h. */
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#define SERVICE_IO_URING
+#endif
+
+#ifdef SERVICE_IO_URING
+static int service_io_uring_wake(struct wait_queue_entry *wait,
+				 unsigned int mode, int sync, void *key);
+#endif
+
+/*
+ * The misc core passes our miscdevice in private_data, it is embedded in
+ * the service; misc_deregister() prevents further opens before the service
+ * is freed.
+ */
 static int service_io_fop_open(struct inode *inode, struct file *file)
 {
-	struct varlink_connection *conn;
+	struct miscdevice *misc = file->private_data;
 	struct varlink_service *service;
+	struct varlink_connection *conn;
 	int r;
 
-	mutex_lock(&service_io_lock);
-	service = idr_find(&service_io_idr, MINOR(inode->i_rdev));
-	if (!service) {
-		mutex_unlock(&service_io_lock);
-		return -ENOENT;
-	}
+	service = container_of(misc, struct varlink_service, misc);
 
 	if (!try_module_get(service->owner))
 		return -ENODEV;
 
 	r = varlink_connection_new(&conn);
-	if (r < 0)
+	if (r < 0) {
+		module_put(service->owner);
 		return r;
+	}
 
 	conn->service = service;
 
+#ifdef SERVICE_IO_URING
+	init_waitqueue_func_entry(&conn->uring_wait, service_io_uring_wake);
+	add_wait_queue(&conn->waitq, &conn->uring_wait);
+#endif
+
 	file->private_data = conn;
-	mutex_unlock(&service_io_lock);
 
 	return 0;
 }
@@ -45,95 +64,271 @@ static int service_io_fop_release(struct inode *inode, struct file *file)
 {
 	struct varlink_connection *conn = file->private_data;
 
+#ifdef SERVICE_IO_URING
+	remove_wait_queue(&conn->waitq, &conn->uring_wait);
+#endif
+
 	module_put(conn->service->owner);
-	varlink_connection_free(conn);
+	varlink_connection_close(conn);
 
 	return 0;
 }
 
-static ssize_t service_io_fop_read(struct file *file, char __user *buf,
-				   size_t count, loff_t *ppos)
+/* Replies, or the loss of replies, are waiting to be read. */
+static bool service_io_has_replies(struct varlink_connection *conn)
 {
-	struct varlink_connection *conn = file->private_data;
-	char *data = NULL;
-	ssize_t size;
+	struct reply_ring *ring;
+
+	if (!reply_queue_empty(&conn->replies) || READ_ONCE(conn->overrun))
+		return true;
+
+	ring = READ_ONCE(conn->ring);
+	return ring && reply_ring_used(ring) > 0;
+}
+
+/* A read() would not block. */
+static bool service_io_readable(struct varlink_connection *conn)
+{
+	if (service_io_has_replies(conn))
+		return true;
+
+	/* Pipelined calls are dispatched by the next read(). */
+	return READ_ONCE(conn->n_calls) > 0 && READ_ONCE(conn->call_finished);
+}
+
+/* Returns -EAGAIN if there is nothing to read; called with conn->lock held. */
+static ssize_t service_io_read(struct varlink_connection *conn,
+			       struct iov_iter *to)
+{
+	struct reply_ring *ring = READ_ONCE(conn->ring);
+
+	lockdep_assert_held(&conn->lock);
 
 	/* Signal once, that we lost one or more messages. */
-	mutex_lock(&conn->lock);
 	if (conn->overrun) {
 		conn->overrun = false;
-		size = -ENOBUFS;
-		goto out;
+		return -ENOBUFS;
 	}
 
-	if (buffer_size(conn->buffer) == 0) {
-		size = -EAGAIN;
-		goto out;
-	}
+	/* The ring holds the older replies. */
+	if (ring && reply_ring_used(ring) > 0)
+		return reply_ring_read(ring, to);
 
-	size = buffer_steal_data(conn->buffer, &data);
-	if (copy_to_user(buf, data, size))
-		size = -EFAULT;
+	if (!reply_queue_empty(&conn->replies))
+		return reply_queue_read(&conn->replies, to);
 
-	kfree(data);
-	conn->buffer = buffer_free(conn->buffer);
+	return -EAGAIN;
+}
 
-out:
-	mutex_unlock(&conn->lock);
-	return size;
+/*
+ * Dispatch calls which waited for the previous call to finish. Returns
+ * -EAGAIN if @nonblock and another context holds the lock.
+ */
+static int service_io_dispatch(struct varlink_connection *conn, bool nonblock)
+{
+	int r;
+
+	if (!nonblock)
+		mutex_lock(&conn->dispatch_lock);
+	else if (!mutex_trylock(&conn->dispatch_lock))
+		return -EAGAIN;
+
+	r = varlink_connection_dispatch(conn);
+	mutex_unlock(&conn->dispatch_lock);
+
+	return r;
 }
 
-static ssize_t service_io_fop_write(struct file *file, const char __user *buf,
-				    size_t count, loff_t *ppos)
+static ssize_t service_io_fop_read_iter(struct kiocb *iocb,
+					struct iov_iter *to)
 {
+	struct file *file = iocb->ki_filp;
 	struct varlink_connection *conn = file->private_data;
-	char *data = NULL;
-	struct json_object *call = NULL;
-	struct json_object *parameters = NULL;
+	ssize_t size;
 	int r;
 
-	if (conn->method)
-		return -EBUSY;
+	for (;;) {
+		r = service_io_dispatch(conn, false);
+		if (r < 0)
+			return r;
 
-	if (count > 128 * 1024)
-		return -EMSGSIZE;
+		mutex_lock(&conn->lock);
+		size = service_io_read(conn, to);
+		mutex_unlock(&conn->lock);
+		if (size != -EAGAIN)
+			return size;
 
-	data = memdup_user(buf, count);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
+		if (file->f_flags & O_NONBLOCK || iocb->ki_flags & IOCB_NOWAIT)
+			return -EAGAIN;
+
+		r = wait_event_interruptible(conn->waitq,
+					     service_io_readable(conn));
+		if (r < 0)
+			return r;
+	}
+}
+
+/*
+ * The call and its envelope are allocated in one arena, released when the
+ * call and everything it handed out are gone. The parameters are parsed
+ * when the call is dispatched to a callback. The queued call is returned
+ * in @callp, it is valid until the dispatch lock is dropped.
+ */
+static int service_io_call(struct varlink_connection *conn, char *data,
+			   struct varlink_call **callp)
+{
+	struct arena *arena = NULL;
+	struct varlink_call *call = NULL;
+	int r;
+
+	if (conn->n_calls >= CONNECTION_PIPELINE_MAX)
+		return -EBUSY;
+
+	r = arena_new(&arena);
+	if (r < 0)
+		return r;
 
-	r = json_object_new_from_string(&call, data);
+	r = varlink_call_new(conn, arena, &call);
 	if (r < 0)
 		goto out;
 
-	r = message_unpack_call(call,
-				&conn->method,
-				&parameters,
-				&conn->flags_call);
+	r = message_unpack_call(arena, data,
+				&call->method,
+				&call->parameters_json,
+				&call->flags);
 	if (r < 0)
 		goto out;
 
-	if (conn->flags_call & VARLINK_CALL_ONEWAY &&
-	    conn->flags_call & VARLINK_CALL_MORE) {
+	if (call->flags & VARLINK_CALL_ONEWAY &&
+	    call->flags & VARLINK_CALL_MORE) {
 		r = -EPROTO;
 		goto out;
 	}
 
-	r = varlink_service_dispatch_call(conn->service,
-					  conn,
-					  parameters);
+	/* Queue the call behind the active one, it keeps the order of replies. */
+	r = varlink_connection_add_call(conn, call);
+	if (r < 0)
+		goto out;
+
+	if (callp)
+		*callp = call;
+
+	call = NULL;
 
 out:
-	if (!(conn->flags_reply & VARLINK_REPLY_CONTINUES)) {
-		kfree(conn->method);
-		conn->method = NULL;
-		conn->flags_call = 0;
-		conn->flags_reply = 0;
+	varlink_call_unref(call);
+	arena_unref(arena);
+
+	return r;
+}
+
+/*
+ * Reserves @size bytes of input behind the start of a call which the last
+ * write() left at the start of the input buffer; returns the carried bytes.
+ */
+static int service_io_input_reserve(struct varlink_connection *conn,
+				    unsigned int size, char **datap)
+{
+	int r;
+
+	if (!conn->input) {
+		r = buffer_pool_get(&conn->input);
+		if (r < 0)
+			return r;
+	}
+
+	return buffer_reserve_keep(conn->input, conn->n_partial,
+				   conn->n_partial + size, datap);
+}
+
+/* The input buffer keeps its allocation, and the carried bytes. */
+static void service_io_input_release(struct varlink_connection *conn)
+{
+	if (conn->input && conn->n_partial == 0)
+		buffer_reset(conn->input);
+}
+
+/*
+ * Every call is terminated by a NUL byte, a single write() can carry any
+ * number of calls. The start of a call which does not end within the
+ * written data is kept and completed by the next write(). A failing call
+ * ends the write, its error is returned if it was the first call; once a
+ * call is consumed, the write is short instead.
+ */
+static ssize_t service_io_fop_write_iter(struct kiocb *iocb,
+					 struct iov_iter *from)
+{
+	struct varlink_connection *conn = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	unsigned int carried;
+	char *data;
+	char *end;
+	char *nul;
+	char *p;
+	int r = 0;
+
+	/* Larger writes are short, the caller writes the rest again. */
+	count = min_t(size_t, count, CONNECTION_MESSAGE_MAX);
+
+	mutex_lock(&conn->dispatch_lock);
+	carried = conn->n_partial;
+	r = service_io_input_reserve(conn, count + 1, &data);
+	if (r < 0)
+		goto unlock;
+
+	if (!copy_from_iter_full(data + carried, count, from)) {
+		r = -EFAULT;
+		goto unlock;
+	}
+
+	/* The carried bytes are part of this write now. */
+	conn->n_partial = 0;
+
+	end = data + carried + count;
+	*end = '\0';
+
+	for (p = data; p < end;) {
+		nul = memchr(p, '\0', end - p);
+		if (!nul)
+			break;
+
+		/* Parsing the call writes NUL bytes into it, find its end first. */
+		r = service_io_call(conn, p, NULL);
+		if (r < 0)
+			break;
+
+		/* The call is consumed, even if its method fails. */
+		p = nul + 1;
+
+		r = varlink_connection_dispatch(conn);
+		if (r < 0)
+			break;
+	}
+
+	/*
+	 * Consumed calls must not be written again, report the bytes up to
+	 * the failure. The carried bytes never hold the end of a call, so at
+	 * least one byte of this write was consumed.
+	 */
+	if (r < 0 || end - p > CONNECTION_MESSAGE_MAX) {
+		if (p > data)
+			r = p - data - carried;
+		else if (r >= 0)
+			r = -EMSGSIZE;
+
+		goto unlock;
+	}
+
+	if (p < end) {
+		memmove(data, p, end - p);
+		conn->n_partial = end - p;
 	}
 
-	json_object_unref(parameters);
-	json_object_unref(call);
-	kfree(data);
+	r = count;
+
+unlock:
+	service_io_input_release(conn);
+	mutex_unlock(&conn->dispatch_lock);
 
 	return r;
 }
@@ -145,19 +340,390 @@ static unsigned int service_io_fop_poll(struct file *file,
 
 	poll_wait(file, &conn->waitq, wait);
 
-	if (buffer_size(conn->buffer) > 0)
+	if (service_io_readable(conn))
 		return POLLIN | POLLRDNORM;
 
 	return 0;
 }
 
+static long service_io_fop_ioctl(struct file *file, unsigned int cmd,
+				 unsigned long arg)
+{
+	struct varlink_connection *conn = file->private_data;
+	struct reply_ring *ring = READ_ONCE(conn->ring);
+	unsigned int value;
+
+	mutex_lock(&conn->lock);
+	switch (cmd) {
+	case FIONREAD:
+		value = reply_queue_size(&conn->replies);
+		if (ring)
+			value += reply_ring_used(ring);
+		break;
+
+	case VARLINK_IOC_QUEUE_DEPTH:
+		value = reply_queue_length(&conn->replies);
+		if (ring)
+			value += reply_ring_count(ring);
+		break;
+
+	default:
+		mutex_unlock(&conn->lock);
+		return -ENOTTY;
+	}
+	mutex_unlock(&conn->lock);
+
+	return put_user(value, (unsigned int __user *)arg);
+}
+
+/*
+ * ->mmap() runs with mmap_lock held, while readers take it in page faults
+ * with conn->lock held. The ring is published without conn->lock, the
+ * loser of a race frees its ring.
+ */
+static int service_io_fop_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct varlink_connection *conn = file->private_data;
+	struct reply_ring *ring;
+	int r;
+
+	ring = READ_ONCE(conn->ring);
+	if (!ring) {
+		r = reply_ring_new(&ring);
+		if (r < 0)
+			return r;
+
+		if (cmpxchg(&conn->ring, NULL, ring)) {
+			reply_ring_free(ring);
+			ring = READ_ONCE(conn->ring);
+		}
+	}
+
+	return reply_ring_mmap(ring, vma);
+}
+
+#ifdef SERVICE_IO_URING
+/* Per-command state, kept in the command itself. */
+struct service_io_uring_pdu {
+	union {
+		/* VARLINK_URING_CMD_READ, waiting in conn->uring_cmds. */
+		struct list_head node;
+
+		/*
+		 * VARLINK_URING_CMD_CALL, waiting for the first reply of its
+		 * call; the command keeps the arena which holds the call.
+		 */
+		struct {
+			struct varlink_call *call;
+			struct reply *message;
+		};
+	};
+	u64 reply;
+	u32 reply_len;
+};
+
+static struct service_io_uring_pdu *service_io_uring_pdu(struct io_uring_cmd *cmd)
+{
+	BUILD_BUG_ON(sizeof(struct service_io_uring_pdu) > sizeof(cmd->pdu));
+
+	return (struct service_io_uring_pdu *)cmd->pdu;
+}
+
+/*
+ * Completes the command with the next replies, or queues it to wait for
+ * them. Returns -EIOCBQUEUED if the command was queued, and -EAGAIN if
+ * @issue_flags do not allow to wait for a lock.
+ *
+ * Replies are pushed without conn->lock, and every push is followed by a
+ * wakeup, which takes uring_lock. The command is queued before looking for
+ * replies, so a reply pushed after the check finds it. If there are
+ * replies, the command is taken back, unless a wakeup already took it to
+ * complete it.
+ */
+static int service_io_uring_read(struct varlink_connection *conn,
+				 struct io_uring_cmd *cmd,
+				 unsigned int issue_flags)
+{
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+	bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+	struct iov_iter iter;
+	bool queued;
+	ssize_t size;
+
+	for (;;) {
+		size = service_io_dispatch(conn, nonblock);
+		if (size < 0)
+			return size;
+
+		spin_lock(&conn->uring_lock);
+		list_add_tail(&pdu->node, &conn->uring_cmds);
+		spin_unlock(&conn->uring_lock);
+
+		if (!service_io_has_replies(conn))
+			return -EIOCBQUEUED;
+
+		spin_lock(&conn->uring_lock);
+		queued = !list_empty(&pdu->node);
+		list_del_init(&pdu->node);
+		spin_unlock(&conn->uring_lock);
+
+		if (!queued)
+			return -EIOCBQUEUED;
+
+		size = import_ubuf(ITER_DEST, u64_to_user_ptr(pdu->reply),
+				   pdu->reply_len, &iter);
+		if (size < 0)
+			return size;
+
+		if (!nonblock)
+			mutex_lock(&conn->lock);
+		else if (!mutex_trylock(&conn->lock))
+			return -EAGAIN;
+
+		size = service_io_read(conn, &iter);
+		mutex_unlock(&conn->lock);
+
+		/* Another reader took the replies. */
+		if (size != -EAGAIN)
+			return size;
+	}
+}
+
+/* Task work may sleep, whatever the flags of the original issue were. */
+static void service_io_uring_complete(struct io_uring_cmd *cmd,
+				      unsigned int issue_flags)
+{
+	struct varlink_connection *conn = cmd->file->private_data;
+	int r;
+
+	r = service_io_uring_read(conn, cmd,
+				  issue_flags & ~IO_URING_F_NONBLOCK);
+	if (r != -EIOCBQUEUED)
+		io_uring_cmd_done(cmd, r, 0, issue_flags);
+}
+
+/* Called for every wakeup of conn->waitq, hands one waiting command a reply. */
+static int service_io_uring_wake(struct wait_queue_entry *wait,
+				 unsigned int mode, int sync, void *key)
+{
+	struct varlink_connection *conn;
+	struct service_io_uring_pdu *pdu;
+
+	conn = container_of(wait, struct varlink_connection, uring_wait);
+
+	spin_lock(&conn->uring_lock);
+	pdu = list_first_entry_or_null(&conn->uring_cmds,
+				       struct service_io_uring_pdu, node);
+	if (pdu)
+		list_del_init(&pdu->node);
+	spin_unlock(&conn->uring_lock);
+
+	if (pdu)
+		io_uring_cmd_complete_in_task(container_of((void *)pdu,
+							   struct io_uring_cmd,
+							   pdu),
+					      service_io_uring_complete);
+
+	return 0;
+}
+
+/*
+ * Copies the reply of the call, which must fit into the buffer of the
+ * command as a whole. A call which ends without a reply fails with
+ * -ENODATA.
+ */
+static void service_io_uring_call_complete(struct io_uring_cmd *cmd,
+					   unsigned int issue_flags)
+{
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+	struct reply *reply = pdu->message;
+	struct iov_iter iter;
+	ssize_t size = -ENODATA;
+	int r;
+
+	if (reply) {
+		size = buffer_size(reply->buffer);
+		if (size > pdu->reply_len)
+			size = -EMSGSIZE;
+
+		if (size >= 0) {
+			r = import_ubuf(ITER_DEST, u64_to_user_ptr(pdu->reply),
+					size, &iter);
+			if (r >= 0)
+				r = buffer_copy_to_iter(reply->buffer, 0,
+							&iter, size);
+			if (r < 0)
+				size = r;
+		}
+
+		reply_unref(reply);
+	}
+
+	arena_unref(pdu->call->arena);
+	io_uring_cmd_done(cmd, size, 0, issue_flags);
+}
+
+/* The reply hook of the call, it may run in any process context. */
+static void service_io_uring_call_reply(struct varlink_call *call,
+					struct reply *reply)
+{
+	struct io_uring_cmd *cmd = call->reply_hook_data;
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+
+	pdu->message = reply ? reply_ref(reply) : NULL;
+	io_uring_cmd_complete_in_task(cmd, service_io_uring_call_complete);
+}
+
+static int service_io_uring_cancel(struct varlink_connection *conn,
+				   struct io_uring_cmd *cmd,
+				   unsigned int issue_flags)
+{
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+	struct varlink_call *call;
+	bool waiting;
+
+	if (cmd->cmd_op == VARLINK_URING_CMD_CALL) {
+		/* Later replies of the call go to the queue. */
+		call = pdu->call;
+		waiting = xchg(&call->reply_hook, NULL);
+		if (waiting)
+			arena_unref(call->arena);
+	} else {
+		spin_lock(&conn->uring_lock);
+		waiting = !list_empty(&pdu->node);
+		list_del_init(&pdu->node);
+		spin_unlock(&conn->uring_lock);
+	}
+
+	/* Otherwise the command is about to complete. */
+	if (waiting)
+		io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+
+	return 0;
+}
+
+/*
+ * Queues the call with the command as its reply hook, before the call can
+ * be dispatched. A oneway call has no reply, its command completes at once.
+ */
+static int service_io_uring_call(struct varlink_connection *conn,
+				 struct io_uring_cmd *cmd,
+				 const char __user *message, u32 size,
+				 unsigned int issue_flags)
+{
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+	struct varlink_call *call;
+	bool oneway;
+	char *data;
+	int r;
+
+	if (size == 0 || size > CONNECTION_MESSAGE_MAX)
+		return -EMSGSIZE;
+
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		if (!mutex_trylock(&conn->dispatch_lock))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&conn->dispatch_lock);
+	}
+
+	r = service_io_input_reserve(conn, size + 1, &data);
+	if (r < 0)
+		goto unlock;
+
+	/* Leave the start of a call carried by write() in place. */
+	data += conn->n_partial;
+
+	if (copy_from_user(data, message, size)) {
+		r = -EFAULT;
+		goto unlock;
+	}
+
+	/* A single call, with or without its terminating NUL. */
+	data[size] = '\0';
+	if (strlen(data) < size - 1) {
+		r = -EINVAL;
+		goto unlock;
+	}
+
+	r = service_io_call(conn, data, &call);
+	if (r < 0)
+		goto unlock;
+
+	oneway = call->flags & VARLINK_CALL_ONEWAY;
+	if (!oneway) {
+		pdu->call = call;
+		pdu->message = NULL;
+		arena_ref(call->arena);
+
+		call->reply_hook_data = cmd;
+		call->reply_hook = service_io_uring_call_reply;
+		io_uring_cmd_mark_cancelable(cmd, issue_flags);
+	}
+
+	r = varlink_connection_dispatch(conn);
+
+	/* The command completes through the hook, even if dispatching failed. */
+	if (!oneway)
+		r = -EIOCBQUEUED;
+
+unlock:
+	service_io_input_release(conn);
+	mutex_unlock(&conn->dispatch_lock);
+
+	return r;
+}
+
+static int service_io_fop_uring_cmd(struct io_uring_cmd *cmd,
+				    unsigned int issue_flags)
+{
+	struct varlink_connection *conn = cmd->file->private_data;
+	struct service_io_uring_pdu *pdu = service_io_uring_pdu(cmd);
+	const struct varlink_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+
+	if (issue_flags & IO_URING_F_CANCEL)
+		return service_io_uring_cancel(conn, cmd, issue_flags);
+
+	pdu->reply = READ_ONCE(ucmd->reply);
+	pdu->reply_len = READ_ONCE(ucmd->reply_len);
+
+	switch (cmd->cmd_op) {
+	case VARLINK_URING_CMD_CALL:
+		return service_io_uring_call(conn, cmd,
+					     u64_to_user_ptr(READ_ONCE(ucmd->call)),
+					     READ_ONCE(ucmd->call_len),
+					     issue_flags);
+
+	case VARLINK_URING_CMD_READ:
+		INIT_LIST_HEAD(&pdu->node);
+		io_uring_cmd_mark_cancelable(cmd, issue_flags);
+		return service_io_uring_read(conn, cmd, issue_flags);
+
+	default:
+		return -EINVAL;
+	}
+}
+#endif
+
 static const struct file_operations service_io_fops = {
 	.owner = THIS_MODULE,
 	.open = service_io_fop_open,
 	.release = service_io_fop_release,
-	.read = service_io_fop_read,
-	.write = service_io_fop_write,
+	.read_iter = service_io_fop_read_iter,
+	.write_iter = service_io_fop_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
 	.poll = service_io_fop_poll,
+	.mmap = service_io_fop_mmap,
+	.unlocked_ioctl = service_io_fop_ioctl,
+#ifdef SERVICE_IO_URING
+	.uring_cmd = service_io_fop_uring_cmd,
+#endif
+	.compat_ioctl = compat_ptr_ioctl,
 	.llseek = noop_llseek
 };
 
@@ -166,21 +732,20 @@ int service_io_register(struct varlink_service *service,
 {
 	int r;
 
+	service->misc.name = kstrdup(device, GFP_KERNEL);
+	if (!service->misc.name)
+		return -ENOMEM;
+
 	service->misc.fops = &service_io_fops;
 	service->misc.minor = MISC_DYNAMIC_MINOR;
-	service->misc.name = kstrdup(device, GFP_KERNEL);
 	service->misc.mode = mode;
 	r = misc_register(&service->misc);
-	if (r < 0)
+	if (r < 0) {
+		kfree(service->misc.name);
+		service->misc.name = NULL;
+		service->misc.minor = 0;
 		return r;
-
-	mutex_lock(&service_io_lock);
-	r = idr_alloc(&service_io_idr, service, service->misc.minor, 0, GFP_KERNEL);
-	if (r <= 0) {
-		misc_deregister(&service->misc);
-		return -EEXIST;
 	}
-	mutex_unlock(&service_io_lock);
 
 	return 0;
 }
@@ -190,10 +755,6 @@ void service_io_unregister(struct varlink_service *service)
 	if (service->misc.minor <= 0)
 		return;
 
-	mutex_lock(&service_io_lock);
-	idr_remove(&service_io_idr, service->misc.minor);
-	mutex_unlock(&service_io_lock);
-
 	misc_deregister(&service->misc);
 	kfree(service->misc.name);
 }
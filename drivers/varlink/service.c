@@ -1,6 +1,8 @@
 #include <linux/slab.h>
-#include <linux/bsearch.h>
-#include <linux/sort.h>
+#include <linux/hashtable.h>
+#include <linux/srcu.h>
+#include <linux/stringhash.h>
+#include <linux/wait_bit.h>
 
 #include "connection.h"
 #include "interface.h"
@@ -17,9 +19,17 @@ struct varlink_service *varlink_service_free(struct varlink_service *service)
 
 	service_io_unregister(service);
 
+	if (service->wq)
+		destroy_workqueue(service->wq);
+
+	reply_cache_clear(&service->cache);
+
 	for (i = 0; i < service->n_ifaces; i++)
-		varlink_interface_free(service->ifaces[i]);
+		varlink_interface_unref(service->ifaces[i]);
 	kfree(service->ifaces);
+	json_array_unref(service->interfaces);
+
+	cleanup_srcu_struct(&service->srcu);
 
 	kfree(service->vendor);
 	kfree(service->product);
@@ -31,57 +41,125 @@ struct varlink_service *varlink_service_free(struct varlink_service *service)
 }
 EXPORT_SYMBOL(varlink_service_free);
 
+/*
+ * Looks up the first @len bytes of @name, which need no terminating NUL.
+ * Called in a read-side section of service->srcu, or with service->lock
+ * held.
+ */
+struct interface_member *varlink_service_find_member(struct varlink_service
+						    *service,
+						    const char *name,
+						    unsigned int len,
+						    unsigned int type)
+{
+	struct interface_member *member;
+
+	hash_for_each_possible_rcu(service->members, member, node,
+				   full_name_hash(NULL, name, len),
+				   srcu_read_lock_held(&service->srcu) ||
+				   lockdep_is_held(&service->lock)) {
+		if (member->type == type &&
+		    strncmp(member->name, name, len) == 0 &&
+		    member->name[len] == '\0')
+			return member;
+	}
+
+	return NULL;
+}
+
+/* Called with service->lock held. */
 static int service_add_interface(struct varlink_service *service,
 				 const char *description)
 {
 	struct varlink_interface *iface;
+	unsigned int i;
 	int r;
 
+	lockdep_assert_held(&service->lock);
+
 	r = varlink_interface_new(&iface, description);
 	if (r < 0)
 		return r;
 
+	if (varlink_service_find_member(service, iface->name,
+					strlen(iface->name),
+					INTERFACE_MEMBER_INTERFACE)) {
+		r = -EEXIST;
+		goto out;
+	}
+
 	if (service->n_ifaces_allocated == service->n_ifaces) {
-		service->n_ifaces_allocated = max(2 * service->n_ifaces_allocated, 2U);
-		service->ifaces = krealloc(service->ifaces,
-					   service->n_ifaces_allocated * sizeof(void *),
-					   GFP_KERNEL);
-		if (!service->ifaces) {
-			varlink_interface_free(iface);
-			return -ENOMEM;
+		struct varlink_interface **ifaces;
+		unsigned int n_allocated;
+
+		n_allocated = max(2 * service->n_ifaces_allocated, 2U);
+		ifaces = krealloc(service->ifaces, n_allocated * sizeof(void *),
+				  GFP_KERNEL);
+		if (!ifaces) {
+			r = -ENOMEM;
+			goto out;
 		}
+
+		service->ifaces = ifaces;
+		service->n_ifaces_allocated = n_allocated;
 	}
-	service->ifaces[service->n_ifaces++] = iface;
 
-	return 0;
-}
+	/* Keep the interfaces sorted by name. */
+	for (i = service->n_ifaces; i > 0; i--) {
+		if (strcmp(service->ifaces[i - 1]->name, iface->name) < 0)
+			break;
 
-static int ifaces_compare(const void *p1, const void *p2)
-{
-	struct varlink_interface *i1 = *(struct varlink_interface **)p1;
-	struct varlink_interface *i2 = *(struct varlink_interface **)p2;
+		service->ifaces[i] = service->ifaces[i - 1];
+	}
+	service->ifaces[i] = iface;
+	service->n_ifaces++;
+	service->interfaces = json_array_unref(service->interfaces);
+
+	for (i = 0; i < iface->n_qualified; i++)
+		hash_add_rcu(service->members, &iface->qualified[i].node,
+			     full_name_hash(NULL, iface->qualified[i].name,
+					    strlen(iface->qualified[i].name)));
 
-	return strcmp(i1->name, i2->name);
+	iface = NULL;
+
+out:
+	varlink_interface_unref(iface);
+	return r;
 }
 
-static struct varlink_interface *interface_find(struct varlink_interface
-						**ifaces,
-						unsigned int n_ifaces,
-						const char *name)
+/*
+ * Returns a reference of the frozen interface names, which are serialized
+ * once until the interfaces change. Called with service->lock held.
+ */
+static int service_get_interfaces(struct varlink_service *service,
+				  struct json_array **arrayp)
 {
-	struct varlink_interface _iface = {
-		.name = (char *)name,
-	};
-	struct varlink_interface *iface = &_iface;
-	struct varlink_interface **ifacep;
+	struct json_array *ifaces = NULL;
+	unsigned int i;
+	int r;
 
-	ifacep = bsearch(&iface, ifaces, n_ifaces, sizeof(void *),
-			 ifaces_compare);
+	lockdep_assert_held(&service->lock);
 
-	if (!ifacep)
-		return NULL;
+	if (!service->interfaces) {
+		r = json_array_new(&ifaces);
+		if (r < 0)
+			return r;
+
+		for (i = 0; i < service->n_ifaces; i++) {
+			r = json_array_append_string(ifaces,
+						     service->ifaces[i]->name);
+			if (r < 0) {
+				json_array_unref(ifaces);
+				return r;
+			}
+		}
+
+		service->interfaces = json_array_freeze(ifaces);
+	}
 
-	return *ifacep;
+	*arrayp = json_array_ref(service->interfaces);
+
+	return 0;
 }
 
 static int org_varlink_service_GetInfo(struct varlink_connection *connection,
@@ -93,50 +171,39 @@ static int org_varlink_service_GetInfo(struct varlink_connection *connection,
 	struct varlink_service *service = userdata;
 	struct json_array *ifaces = NULL;
 	struct json_object *info = NULL;
-	unsigned int i;
 	int r;
 
 	r = json_object_new(&info);
 	if (r < 0)
 		goto out;
 
-	json_object_set_string(info, "vendor", service->vendor);
+	r = json_object_set_string(info, "vendor", service->vendor);
 	if (r < 0)
 		goto out;
 
-	json_object_set_string(info, "product", service->product);
+	r = json_object_set_string(info, "product", service->product);
 	if (r < 0)
 		goto out;
 
-	json_object_set_string(info, "version", service->version);
+	r = json_object_set_string(info, "version", service->version);
 	if (r < 0)
 		goto out;
 
-	json_object_set_string(info, "url", service->url);
+	r = json_object_set_string(info, "url", service->url);
 	if (r < 0)
 		goto out;
 
-	r = json_array_new(&ifaces);
+	mutex_lock(&service->lock);
+	r = service_get_interfaces(service, &ifaces);
+	mutex_unlock(&service->lock);
 	if (r < 0)
 		goto out;
 
-	for (i = 0; i < service->n_ifaces; i++) {
-		r = json_array_append_string(ifaces, service->ifaces[i]->name);
-		if (r < 0)
-			goto out;
-	}
-
-	json_object_set_array(info, "interfaces", ifaces);
+	r = json_object_set_array(info, "interfaces", ifaces);
 	if (r < 0)
 		goto out;
 
-	ifaces = NULL;
-
 	r = varlink_connection_reply(connection, 0, info);
-	if (r < 0)
-		goto out;
-
-	info = NULL;
 
 out:
 	json_array_unref(ifaces);
@@ -153,8 +220,10 @@ static int org_varlink_service_GetInterfaceDescription(struct varlink_connection
 {
 	struct varlink_service *service = userdata;
 	const char *name;
-	struct varlink_interface *iface;
+	struct interface_member *member;
 	struct json_object *reply = NULL;
+	bool found;
+	int idx;
 	int r;
 
 	if (json_object_get_string(parameters, "interface", &name) < 0)
@@ -162,17 +231,27 @@ static int org_varlink_service_GetInterfaceDescription(struct varlink_connection
 						"org.varlink.service.InvalidParameter",
 						NULL);
 
-	iface = interface_find(service->ifaces, service->n_ifaces, name);
-	if (!iface)
-		return varlink_connection_error(connection,
-						"org.varlink.service.InterfaceNotFound",
-						NULL);
-
 	r = json_object_new(&reply);
 	if (r < 0)
+		return r;
+
+	/* The description is copied before the interface can be removed. */
+	idx = srcu_read_lock(&service->srcu);
+	member = varlink_service_find_member(service, name, strlen(name),
+					     INTERFACE_MEMBER_INTERFACE);
+	found = member && !READ_ONCE(member->iface->removed);
+	if (found)
+		r = json_object_set_string(reply, "description",
+					   member->iface->description);
+	srcu_read_unlock(&service->srcu, idx);
+
+	if (!found) {
+		r = varlink_connection_error(connection,
+					     "org.varlink.service.InterfaceNotFound",
+					     NULL);
 		goto out;
+	}
 
-	r = json_object_set_string(reply, "description", iface->description);
 	if (r < 0)
 		goto out;
 
@@ -201,6 +280,11 @@ int varlink_service_new(struct varlink_service **servicep,
 		return -ENOMEM;
 
 	service->owner = owner;
+	mutex_init(&service->lock);
+	hash_init(service->members);
+	reply_cache_init(&service->cache, device);
+	service->max_queued = SERVICE_ASYNC_QUEUED_MAX;
+	atomic_set(&service->n_queued, 0);
 	service->vendor = kstrdup(vendor, GFP_KERNEL);
 	service->product = kstrdup(product, GFP_KERNEL);
 	service->version = kstrdup(version, GFP_KERNEL);
@@ -211,11 +295,28 @@ int varlink_service_new(struct varlink_service **servicep,
 		goto out;
 	}
 
+	r = init_srcu_struct(&service->srcu);
+	if (r < 0)
+		goto out;
+
+	service->wq = alloc_workqueue("varlink-%s", WQ_UNBOUND, 0, device);
+	if (!service->wq) {
+		r = -ENOMEM;
+		goto out;
+	}
+
 	/* Add org.varlink.service interface */
-	r = service_add_interface(service, org_varlink_service_varlink);
+	r = varlink_service_add_interface(service, org_varlink_service_varlink);
 	if (r < 0)
 		goto out;
 
+	/* Register custom interfaces. */
+	for (i = 0; ifacesv[i]; i++) {
+		r = varlink_service_add_interface(service, ifacesv[i]);
+		if (r < 0)
+			goto out;
+	}
+
 	r = varlink_service_register_callback(service,
 					      "org.varlink.service.GetInfo",
 					      org_varlink_service_GetInfo,
@@ -230,15 +331,17 @@ int varlink_service_new(struct varlink_service **servicep,
 	if (r < 0)
 		goto out;
 
-	/* Register custom interfaces. */
-	for (i = 0; ifacesv[i]; i++) {
-		r = service_add_interface(service, ifacesv[i]);
-		if (r < 0)
-			goto out;
-	}
+	r = varlink_service_set_method_flags(service,
+					     "org.varlink.service.GetInfo",
+					     VARLINK_METHOD_CACHE);
+	if (r < 0)
+		goto out;
 
-	sort(service->ifaces, service->n_ifaces, sizeof(void *),
-	     ifaces_compare, NULL);
+	r = varlink_service_set_method_flags(service,
+					     "org.varlink.service.GetInterfaceDescription",
+					     VARLINK_METHOD_CACHE);
+	if (r < 0)
+		goto out;
 
 	r = service_io_register(service, device, mode);
 	if (r < 0)
@@ -253,46 +356,74 @@ out:
 }
 EXPORT_SYMBOL(varlink_service_new);
 
-int varlink_service_find_interface(struct varlink_service *service,
-				   const char *method,
-				   struct varlink_interface **ifacep,
-				   const char **methodp)
+/*
+ * Adds an interface to a running service. Its methods fail with
+ * MethodNotImplemented until their callbacks are registered.
+ */
+int varlink_service_add_interface(struct varlink_service *service,
+				  const char *description)
 {
-	const char *method_name;
-	char *interface_name = NULL;
-	struct varlink_interface *iface;
-	int r = 0;
+	int r;
 
-	/* Split fully-qualified method name in interface and method name. */
-	method_name = strrchr(method, '.');
-	if (!method_name)
-		return -EINVAL;
+	mutex_lock(&service->lock);
+	r = service_add_interface(service, description);
+	mutex_unlock(&service->lock);
 
-	interface_name = kstrndup(method, method_name - method, GFP_KERNEL);
-	if (!interface_name) {
-		r = -ENOMEM;
-		goto out;
-	}
+	/* The reply of GetInfo changed. */
+	if (r >= 0)
+		reply_cache_invalidate(&service->cache, NULL, NULL);
 
-	method_name++;
+	return r;
+}
+EXPORT_SYMBOL(varlink_service_add_interface);
+
+/*
+ * Removes an interface from a running service, waiting for its callbacks
+ * which are running. Calls which are still queued fail with
+ * InterfaceNotFound. It must not be called from one of its callbacks.
+ */
+int varlink_service_remove_interface(struct varlink_service *service,
+				     const char *name)
+{
+	struct varlink_interface *iface = NULL;
+	unsigned int i;
 
-	iface = interface_find(service->ifaces, service->n_ifaces,
-			       interface_name);
-	if (!iface) {
-		r = -ESRCH;
-		goto out;
+	mutex_lock(&service->lock);
+	for (i = 0; i < service->n_ifaces; i++) {
+		if (strcmp(service->ifaces[i]->name, name) == 0) {
+			iface = service->ifaces[i];
+			break;
+		}
 	}
 
-	if (ifacep)
-		*ifacep = iface;
+	if (!iface || strcmp(name, "org.varlink.service") == 0) {
+		mutex_unlock(&service->lock);
+		return iface ? -EPERM : -ESRCH;
+	}
 
-	if (methodp)
-		*methodp = method_name;
+	memmove(service->ifaces + i, service->ifaces + i + 1,
+		(service->n_ifaces - i - 1) * sizeof(void *));
+	service->n_ifaces--;
+	service->interfaces = json_array_unref(service->interfaces);
 
-out:
-	kfree(interface_name);
-	return r;
+	WRITE_ONCE(iface->removed, true);
+	for (i = 0; i < iface->n_qualified; i++)
+		hash_del_rcu(&iface->qualified[i].node);
+	mutex_unlock(&service->lock);
+
+	/* Pairs with the barrier in varlink_service_dispatch_call(). */
+	smp_mb();
+	wait_var_event(&iface->n_running, atomic_read(&iface->n_running) == 0);
+
+	synchronize_srcu(&service->srcu);
+
+	/* Entries of the interface's methods must not outlive it. */
+	reply_cache_invalidate(&service->cache, NULL, NULL);
+	varlink_interface_unref(iface);
+
+	return 0;
 }
+EXPORT_SYMBOL(varlink_service_remove_interface);
 
 int varlink_service_register_callback(struct varlink_service *service,
 				      const char *method,
@@ -305,25 +436,165 @@ int varlink_service_register_callback(struct varlink_service *service,
 				      ),
 				      void *userdata)
 {
-	struct varlink_interface *iface;
-	const char *method_name;
+	struct interface_member *member;
+	int r = 0;
+
+	mutex_lock(&service->lock);
+	member = varlink_service_find_member(service, method, strlen(method),
+					     INTERFACE_MEMBER_METHOD);
+	if (member) {
+		WRITE_ONCE(member->method->userdata, userdata);
+		WRITE_ONCE(member->method->callback, callback);
+	} else {
+		r = -ESRCH;
+	}
+	mutex_unlock(&service->lock);
+
+	return r;
+}
+EXPORT_SYMBOL(varlink_service_register_callback);
+
+int varlink_service_set_method_flags(struct varlink_service *service,
+				     const char *method,
+				     unsigned long flags)
+{
+	struct interface_member *member;
+	int r = 0;
+
+	mutex_lock(&service->lock);
+	member = varlink_service_find_member(service, method, strlen(method),
+					     INTERFACE_MEMBER_METHOD);
+	if (member)
+		WRITE_ONCE(member->method->flags, flags);
+	else
+		r = -ESRCH;
+	mutex_unlock(&service->lock);
+
+	return r;
+}
+EXPORT_SYMBOL(varlink_service_set_method_flags);
+
+/*
+ * Limits the asynchronous calls of all connections: @max_active run at the
+ * same time, zero selects the workqueue default; @max_queued are accepted
+ * before write() fails with -EBUSY.
+ */
+int varlink_service_set_async_limits(struct varlink_service *service,
+				     unsigned int max_active,
+				     unsigned int max_queued)
+{
+	if (max_active > WQ_MAX_ACTIVE || max_queued == 0)
+		return -EINVAL;
+
+	workqueue_set_max_active(service->wq, max_active ?: WQ_DFL_ACTIVE);
+	WRITE_ONCE(service->max_queued, max_queued);
+
+	return 0;
+}
+EXPORT_SYMBOL(varlink_service_set_async_limits);
+
+/*
+ * Drops the cached replies of @method, or only the one to @parameters.
+ * Replies which are computed while it runs are not stored.
+ */
+int varlink_service_invalidate(struct varlink_service *service,
+			       const char *method,
+			       struct json_object *parameters)
+{
+	struct interface_member *member;
+	struct reply_cache_key *key = NULL;
+	int r = 0;
+
+	member = varlink_service_resolve_method(service, method);
+	if (!member)
+		return -ESRCH;
+
+	if (parameters) {
+		r = reply_cache_key_new(&service->cache, NULL, member,
+					parameters, &key);
+		if (r < 0) {
+			/* Such parameters are never cached. */
+			if (r == -E2BIG)
+				r = 0;
+			goto out;
+		}
+	}
+
+	reply_cache_invalidate(&service->cache, member, key);
+
+out:
+	kfree(key);
+	varlink_interface_unref(member->iface);
+	return r;
+}
+EXPORT_SYMBOL(varlink_service_invalidate);
+
+/*
+ * Resolves the method of a call when it is queued. The call keeps the
+ * interface, even if it is removed before the call is dispatched.
+ */
+struct interface_member *varlink_service_resolve_method(struct varlink_service
+						       *service,
+						       const char *method)
+{
+	struct interface_member *member;
+	int idx;
+
+	idx = srcu_read_lock(&service->srcu);
+	member = varlink_service_find_member(service, method, strlen(method),
+					     INTERFACE_MEMBER_METHOD);
+	if (member)
+		varlink_interface_ref(member->iface);
+	srcu_read_unlock(&service->srcu, idx);
+
+	return member;
+}
+
+/*
+ * Replies from the cache, or returns -ENOENT to run the callback, which
+ * stores its reply. The key is allocated in the call's arena, a miss
+ * keeps it to store the reply.
+ */
+static int service_reply_cached(struct varlink_service *service,
+				struct varlink_call *call,
+				struct json_object *parameters)
+{
+	struct reply_cache_key *key;
+	struct reply *reply;
 	int r;
 
-	r = varlink_service_find_interface(service, method, &iface,
-					   &method_name);
-	if (r < 0)
+	if (reply_cache_key_new(&service->cache, call->arena, call->member,
+				parameters, &key) < 0)
+		return -ENOENT;
+
+	reply = reply_cache_lookup(&service->cache, key);
+	if (reply) {
+		r = varlink_call_push_reply(call, reply, 0);
+		reply_unref(reply);
 		return r;
+	}
+
+	call->cache_key = key;
 
-	return varlink_interface_set_method(iface, method_name, callback, userdata);
+	return -ENOENT;
 }
-EXPORT_SYMBOL(varlink_service_register_callback);
 
+/*
+ * Only the lookups run in read-side sections of srcu. A running callback
+ * is counted in its interface instead, removing the interface waits for
+ * the callbacks of that interface only.
+ */
 int varlink_service_dispatch_call(struct varlink_service *service,
-				  struct varlink_connection *connection,
-				  struct json_object *parameters)
+				  struct varlink_connection *connection)
 {
+	struct varlink_call *call = connection->call;
 	struct varlink_interface *iface;
-	const char *method_name;
+	struct method *method;
+	const char *dot;
+	void *userdata;
+	bool found;
+	int idx;
+	int r;
 	int (*callback)(
 		struct varlink_connection *connection,
 		const char *method,
@@ -331,27 +602,75 @@ int varlink_service_dispatch_call(struct varlink_service *service,
 		long long flags,
 		void *userdata
 	);
-	void *userdata;
-	int r;
 
-	r = varlink_service_find_interface(service, connection->method,
-					   &iface, &method_name);
-	if (r < 0)
-		return varlink_connection_error(connection,
-						"org.varlink.service.InterfaceNotFound",
-						NULL);
+	/*
+	 * The call was resolved when it was queued. Its interface may have
+	 * been removed and added again since, look the method up again.
+	 */
+	if (call->member && READ_ONCE(call->member->iface->removed)) {
+		varlink_interface_unref(call->member->iface);
+		call->member = varlink_service_resolve_method(service,
+							      call->method);
+	}
+
+	if (!call->member || READ_ONCE(call->member->iface->removed)) {
+		dot = strrchr(call->method, '.');
+		idx = srcu_read_lock(&service->srcu);
+		found = dot &&
+			varlink_service_find_member(service, call->method,
+						    dot - call->method,
+						    INTERFACE_MEMBER_INTERFACE);
+		srcu_read_unlock(&service->srcu, idx);
+		if (!found)
+			return varlink_connection_error(connection,
+							"org.varlink.service.InterfaceNotFound",
+							NULL);
 
-	r = varlink_interface_find_method(iface, method_name, &callback, &userdata);
-	if (r < 0)
 		return varlink_connection_error(connection,
 						"org.varlink.service.MethodNotFound",
 						NULL);
+	}
 
+	method = call->member->method;
+	callback = READ_ONCE(method->callback);
+	userdata = READ_ONCE(method->userdata);
 	if (!callback)
 		return varlink_connection_error(connection,
 						"org.varlink.service.MethodNotImplemented",
 						NULL);
 
-	return callback(connection, connection->method, parameters,
-			connection->flags_call, userdata);
+	/* Only calls which reach a callback pay for their parameters. */
+	r = varlink_call_parse_parameters(call);
+	if (r == -EINVAL || r == -EDOM)
+		return varlink_connection_error(connection,
+						"org.varlink.service.InvalidParameter",
+						NULL);
+	if (r < 0)
+		return r;
+
+	if (READ_ONCE(method->flags) & VARLINK_METHOD_CACHE &&
+	    !(call->flags & (VARLINK_CALL_MORE | VARLINK_CALL_ONEWAY))) {
+		r = service_reply_cached(service, call, call->parameters);
+		if (r != -ENOENT)
+			return r;
+	}
+
+	iface = call->member->iface;
+	atomic_inc(&iface->n_running);
+
+	/* Pairs with the barrier in varlink_service_remove_interface(). */
+	smp_mb__after_atomic();
+	if (READ_ONCE(iface->removed))
+		r = varlink_connection_error(connection,
+					     "org.varlink.service.InterfaceNotFound",
+					     NULL);
+	else
+		r = callback(connection, call->method, call->parameters,
+			     call->flags, userdata);
+
+	if (atomic_dec_and_test(&iface->n_running))
+		wake_up_var(&iface->n_running);
+
+	return r;
 }
+
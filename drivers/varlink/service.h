@@ -1,11 +1,19 @@
 #ifndef _SERVICE_H_
 #define _SERVICE_H_
 
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
 #include <linux/json.h>
 #include <linux/varlink.h>
 #include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
 
-#include "service.h"
+#include "interface.h"
+#include "reply-cache.h"
+
+#define SERVICE_MEMBERS_BITS 8
 
 struct varlink_service {
 	struct module *owner;
@@ -15,19 +23,45 @@ struct varlink_service {
 	char *version;
 	char *url;
 
+	/* Protects the interfaces, sorted by name, and changes of members. */
+	struct mutex lock;
 	struct varlink_interface **ifaces;
 	unsigned int n_ifaces;
 	unsigned int n_ifaces_allocated;
 
+	/* Frozen names of the interfaces for GetInfo, built when needed. */
+	struct json_array *interfaces;
+
+	/*
+	 * Fully qualified names of all interfaces, methods and errors. Lookups
+	 * run in read-side sections of srcu.
+	 */
+	struct srcu_struct srcu;
+	DECLARE_HASHTABLE(members, SERVICE_MEMBERS_BITS);
+
 	struct miscdevice misc;
+
+	/* Runs calls of VARLINK_METHOD_ASYNC methods. */
+	struct workqueue_struct *wq;
+	unsigned int max_queued;
+	atomic_t n_queued;
+
+	/* Replies of VARLINK_METHOD_CACHE methods. */
+	struct reply_cache cache;
 };
 
-int varlink_service_find_interface(struct varlink_service *service,
-				   const char *member,
-				   struct varlink_interface **ifacep,
-				   const char **memberp);
+/* Default limit of asynchronous calls accepted but not yet finished. */
+#define SERVICE_ASYNC_QUEUED_MAX 256
+
+struct interface_member *varlink_service_find_member(struct varlink_service
+						    *service,
+						    const char *name,
+						    unsigned int len,
+						    unsigned int type);
+struct interface_member *varlink_service_resolve_method(struct varlink_service
+						       *service,
+						       const char *method);
 
 int varlink_service_dispatch_call(struct varlink_service *service,
-				  struct varlink_connection *connection,
-				  struct json_object *parameters);
+				  struct varlink_connection *connection);
 #endif
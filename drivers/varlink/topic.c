@@ -0,0 +1,168 @@
+#include <linux/json.h>
+#include <linux/slab.h>
+#include <linux/varlink.h>
+
+#include "connection.h"
+#include "message.h"
+#include "reply.h"
+#include "topic.h"
+
+/*
+ * A topic delivers every published message as a further reply to all
+ * calls which subscribed to it. The message is serialized once, all
+ * subscribers queue a reference to the same reply.
+ */
+struct subscription {
+	/* One for the topic and the connection, one while @entry is queued. */
+	refcount_t refcount;
+	struct list_head topic_node;
+	struct list_head conn_node;
+
+	struct varlink_topic *topic;
+	struct varlink_call *call;
+
+	/*
+	 * Queues a message without an allocation, unless the subscriber did
+	 * not read the previous one yet.
+	 */
+	struct reply_entry entry;
+	unsigned long queued;
+};
+
+int varlink_topic_new(struct varlink_topic **topicp)
+{
+	struct varlink_topic *topic;
+
+	topic = kzalloc(sizeof(struct varlink_topic), GFP_KERNEL);
+	if (!topic)
+		return -ENOMEM;
+
+	refcount_set(&topic->refcount, 1);
+	mutex_init(&topic->lock);
+	INIT_LIST_HEAD(&topic->subscriptions);
+
+	*topicp = topic;
+	return 0;
+}
+EXPORT_SYMBOL(varlink_topic_new);
+
+static void topic_unref(struct varlink_topic *topic)
+{
+	if (refcount_dec_and_test(&topic->refcount))
+		kfree(topic);
+}
+
+/* Subscriptions keep the topic until their connections are closed. */
+struct varlink_topic *varlink_topic_free(struct varlink_topic *topic)
+{
+	if (topic)
+		topic_unref(topic);
+
+	return NULL;
+}
+EXPORT_SYMBOL(varlink_topic_free);
+
+static void subscription_unref(struct subscription *sub)
+{
+	if (refcount_dec_and_test(&sub->refcount))
+		kfree(sub);
+}
+
+/* The reader consumed the message, or it was not queued. */
+static void subscription_release_entry(struct reply_entry *entry)
+{
+	struct subscription *sub;
+
+	sub = container_of(entry, struct subscription, entry);
+	smp_store_release(&sub->queued, 0);
+	subscription_unref(sub);
+}
+
+/*
+ * Subscribes the active call, which must be a call with "more". Published
+ * messages are delivered as long as the call continues.
+ */
+int varlink_topic_subscribe(struct varlink_topic *topic,
+			    struct varlink_connection *conn)
+{
+	struct subscription *sub;
+
+	if (!conn->call || !(conn->call->flags & VARLINK_CALL_MORE))
+		return -EPROTO;
+
+	sub = kzalloc(sizeof(struct subscription), GFP_KERNEL);
+	if (!sub)
+		return -ENOMEM;
+
+	refcount_set(&sub->refcount, 1);
+	refcount_inc(&topic->refcount);
+	sub->topic = topic;
+	sub->call = varlink_call_ref(conn->call);
+	sub->entry.release = subscription_release_entry;
+
+	mutex_lock(&conn->lock);
+	list_add_tail(&sub->conn_node, &conn->subscriptions);
+	mutex_unlock(&conn->lock);
+
+	mutex_lock(&topic->lock);
+	list_add_tail(&sub->topic_node, &topic->subscriptions);
+	mutex_unlock(&topic->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL(varlink_topic_subscribe);
+
+/*
+ * The message is pushed to the subscribers under the topic's lock, which
+ * keeps their calls, and orders the messages of concurrent publishers.
+ */
+int varlink_topic_publish(struct varlink_topic *topic,
+			  struct json_object *parameters)
+{
+	struct reply *reply;
+	struct subscription *sub;
+	struct reply_entry *entry;
+	int r;
+
+	r = message_serialize_reply(NULL, parameters, VARLINK_REPLY_CONTINUES,
+				    &reply);
+	if (r < 0)
+		return r;
+
+	/* A subscriber which cannot take the message loses it. */
+	mutex_lock(&topic->lock);
+	list_for_each_entry(sub, &topic->subscriptions, topic_node) {
+		entry = NULL;
+		if (!xchg(&sub->queued, 1)) {
+			refcount_inc(&sub->refcount);
+			entry = &sub->entry;
+		}
+
+		varlink_call_push_entry(sub->call, reply, entry,
+					VARLINK_REPLY_CONTINUES);
+	}
+	mutex_unlock(&topic->lock);
+
+	reply_unref(reply);
+	return 0;
+}
+EXPORT_SYMBOL(varlink_topic_publish);
+
+void varlink_topic_connection_closed(struct varlink_connection *conn)
+{
+	struct subscription *sub, *tmp;
+
+	list_for_each_entry_safe(sub, tmp, &conn->subscriptions, conn_node) {
+		struct varlink_topic *topic = sub->topic;
+
+		mutex_lock(&topic->lock);
+		list_del(&sub->topic_node);
+		mutex_unlock(&topic->lock);
+
+		topic_unref(topic);
+		varlink_call_unref(sub->call);
+		subscription_unref(sub);
+	}
+
+	INIT_LIST_HEAD(&conn->subscriptions);
+}
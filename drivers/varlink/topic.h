@@ -0,0 +1,19 @@
+#ifndef _TOPIC_H_
+#define _TOPIC_H_
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/varlink.h>
+
+struct varlink_topic {
+	/* One for the owner, one for every subscription. */
+	refcount_t refcount;
+
+	/* Serializes publishers, and changes of the subscriptions. */
+	struct mutex lock;
+	struct list_head subscriptions;
+};
+
+void varlink_topic_connection_closed(struct varlink_connection *conn);
+#endif
@@ -5,10 +5,12 @@
 
 struct json_object;
 struct json_array;
+struct json_writer;
 
 int json_object_new(struct json_object **objectp);
 struct json_object *json_object_ref(struct json_object *object);
 struct json_object *json_object_unref(struct json_object *object);
+struct json_object *json_object_freeze(struct json_object *object);
 unsigned int json_object_get_field_names(struct json_object *object,
 					 const char ***namesp);
 
@@ -40,6 +42,7 @@ int json_object_set_object(struct json_object *object, const char *field,
 int json_array_new(struct json_array **arrayp);
 struct json_array *json_array_ref(struct json_array *array);
 struct json_array *json_array_unref(struct json_array *array);
+struct json_array *json_array_freeze(struct json_array *array);
 unsigned int json_array_get_n_elements(struct json_array *array);
 
 int json_array_get_bool(struct json_array *array, unsigned int index, bool *bp);
@@ -59,4 +62,18 @@ int json_array_append_array(struct json_array *array,
 			    struct json_array *element);
 int json_array_append_object(struct json_array *array,
 			     struct json_object *object);
+
+/*
+ * Streaming output, written without building objects. Values inside an
+ * object follow a key. Once a call fails, all further calls fail.
+ */
+int json_writer_begin_object(struct json_writer *writer);
+int json_writer_end_object(struct json_writer *writer);
+int json_writer_begin_array(struct json_writer *writer);
+int json_writer_end_array(struct json_writer *writer);
+int json_writer_key(struct json_writer *writer, const char *key);
+int json_writer_bool(struct json_writer *writer, bool b);
+int json_writer_int(struct json_writer *writer, long long i);
+int json_writer_string(struct json_writer *writer, const char *string);
+int json_writer_object(struct json_writer *writer, struct json_object *object);
 #endif
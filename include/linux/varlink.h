@@ -1,6 +1,8 @@
 #ifndef _VARLINK_H_
 #define _VARLINK_H_
 
+#include <uapi/linux/varlink.h>
+
 #include "json.h"
 
 /*
@@ -18,8 +20,25 @@ enum {
 	VARLINK_REPLY_CONTINUES = 1
 };
 
+/*
+ * Flags of a method implementation.
+ */
+enum {
+	/* Run on the service's workqueue, not in the caller's write(). */
+	VARLINK_METHOD_ASYNC = 1,
+
+	/*
+	 * Replies only depend on the parameters, they are cached until
+	 * varlink_service_invalidate() is called. Calls with "more" or
+	 * "oneway" always reach the callback.
+	 */
+	VARLINK_METHOD_CACHE = 2
+};
+
 struct varlink_service;
 struct varlink_connection;
+struct varlink_call;
+struct varlink_topic;
 
 int varlink_service_new(struct varlink_service **servicep,
 			const char *device, mode_t mode,
@@ -31,6 +50,11 @@ int varlink_service_new(struct varlink_service **servicep,
 			const char *ifacesv[]);
 struct varlink_service *varlink_service_free(struct varlink_service *service);
 
+int varlink_service_add_interface(struct varlink_service *service,
+				  const char *description);
+int varlink_service_remove_interface(struct varlink_service *service,
+				     const char *name);
+
 int varlink_service_register_callback(struct varlink_service *service,
 				      const char *method,
 				      int (*callback)(
@@ -41,6 +65,15 @@ int varlink_service_register_callback(struct varlink_service *service,
 					      void *userdata
 				      ),
 				      void *userdata);
+int varlink_service_set_method_flags(struct varlink_service *service,
+				     const char *method,
+				     unsigned long flags);
+int varlink_service_set_async_limits(struct varlink_service *service,
+				     unsigned int max_active,
+				     unsigned int max_queued);
+int varlink_service_invalidate(struct varlink_service *service,
+			       const char *method,
+			       struct json_object *parameters);
 
 int varlink_connection_reply(struct varlink_connection *connection,
 			     long long flags,
@@ -49,10 +82,56 @@ int varlink_connection_error(struct varlink_connection *connection,
 			     const char *error,
 			     struct json_object *parameters);
 
+/*
+ * Writes the parameters of a reply with a json_writer, which is positioned
+ * inside the parameters object. Every successful begin needs an end, which
+ * queues the reply or returns the first error of the writer.
+ */
+int varlink_connection_reply_begin(struct varlink_connection *connection,
+				   long long flags,
+				   struct json_writer **writerp);
+int varlink_connection_reply_end(struct varlink_connection *connection);
+
+struct varlink_connection *varlink_connection_ref(struct varlink_connection
+						  *conn);
+struct varlink_connection *varlink_connection_unref(struct varlink_connection
+						    *conn);
+
+/*
+ * A handle of the active call, to reply after the callback returned. The
+ * following calls wait until the last reply, or until the handle is dropped.
+ * Replies to a closed connection fail with -ENOTCONN.
+ *
+ * Replying to and dropping a handle may sleep, they must be called from
+ * process context, for example from a work item, but not from a timer,
+ * softirq or atomic notifier.
+ */
+struct varlink_call *varlink_connection_get_call(struct varlink_connection
+						 *conn);
+struct varlink_call *varlink_call_ref(struct varlink_call *call);
+struct varlink_call *varlink_call_unref(struct varlink_call *call);
+int varlink_call_reply(struct varlink_call *call,
+		       long long flags,
+		       struct json_object *parameters);
+int varlink_call_error(struct varlink_call *call,
+		       const char *error,
+		       struct json_object *parameters);
+int varlink_call_reply_begin(struct varlink_call *call,
+			     long long flags,
+			     struct json_writer **writerp);
+int varlink_call_reply_end(struct varlink_call *call);
+
 void varlink_connection_set_closed_callback(struct varlink_connection *conn,
 					    void (*callback)(
 						    struct varlink_connection *conn,
 						    void *userdata
 					    ),
 					    void *userdata);
+
+int varlink_topic_new(struct varlink_topic **topicp);
+struct varlink_topic *varlink_topic_free(struct varlink_topic *topic);
+int varlink_topic_subscribe(struct varlink_topic *topic,
+			    struct varlink_connection *conn);
+int varlink_topic_publish(struct varlink_topic *topic,
+			  struct json_object *parameters);
 #endif
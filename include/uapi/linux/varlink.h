@@ -0,0 +1,55 @@
+#ifndef _UAPI_LINUX_VARLINK_H
+#define _UAPI_LINUX_VARLINK_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define VARLINK_IOC_MAGIC 0xb8
+
+/*
+ * Number of reply messages queued on the connection, including a message
+ * which has been read partially, and messages in the reply ring which
+ * userspace has not consumed.
+ */
+#define VARLINK_IOC_QUEUE_DEPTH _IOR(VARLINK_IOC_MAGIC, 0x00, __u32)
+
+/*
+ * Reply ring, mapped with mmap() at offset 0 with a length of one page plus
+ * VARLINK_RING_SIZE. The page holds struct varlink_ring, the data follows
+ * at @offset. The kernel appends NUL-terminated reply messages and advances
+ * @head after each complete message, userspace advances @tail after it
+ * consumed data. Both indices run freely and are taken modulo @size.
+ *
+ * Replies which do not fit into the ring are queued for read(), and all
+ * further replies are queued until that queue is drained; the ring always
+ * carries the older replies. read() consumes the ring first.
+ */
+#define VARLINK_RING_SIZE (128 * 1024)
+
+struct varlink_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 size;
+	__u32 offset;
+};
+
+/*
+ * io_uring passthrough, IORING_OP_URING_CMD with struct varlink_uring_cmd
+ * in the command area of the SQE. VARLINK_URING_CMD_CALL submits the single
+ * call in @call and completes with the first reply of that call, copied to
+ * @reply; it fails with -EMSGSIZE if the reply does not fit into @reply_len
+ * bytes, and with -ENODATA if the call ends without a reply. A call with
+ * "oneway" completes at once with 0. VARLINK_URING_CMD_READ completes like
+ * a read() of @reply_len bytes into @reply, with the next queued replies in
+ * call order; further replies of a call with "more" are collected with it.
+ */
+#define VARLINK_URING_CMD_CALL 0x00
+#define VARLINK_URING_CMD_READ 0x01
+
+struct varlink_uring_cmd {
+	__u64 call;
+	__u64 reply;
+	__u32 call_len;
+	__u32 reply_len;
+};
+#endif